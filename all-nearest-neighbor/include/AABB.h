@@ -2,19 +2,26 @@
 
 #include "Point.h"
 
-struct AABB
+template <uint32_t Dim, typename Coord>
+struct BasicAABB
 {
-	Point min, max;
+	typedef BasicPoint<Dim, Coord> PointType;
 
-	AABB() = default;
-	AABB(Point minn, Point maxx)
+	PointType min, max;
+
+	BasicAABB() = default;
+	BasicAABB(PointType minn, PointType maxx)
 	{
 		min = minn;
 		max = maxx;
 	}
 
-	Point size()
+	PointType size()
 	{
 		return max - min;
 	}
 };
+
+typedef BasicAABB<2, int32_t> AABB;
+typedef BasicAABB<2, float> AABB2f;
+typedef BasicAABB<3, float> AABB3f;
\ No newline at end of file
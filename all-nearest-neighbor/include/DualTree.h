@@ -0,0 +1,60 @@
+#pragma once
+
+#include "KdTree.h"
+#include "TaskPool.h"
+#include <vector>
+#include <cstdint>
+
+// Finds the nearest neighbor of every point of a KdTree by traversing the tree against itself: query nodes and
+// reference nodes are descended together, and a pair is dropped as soon as the reference node's box is farther from
+// the query node's box than the worst candidate found so far for the query node's points. The decisions taken near
+// the root are then shared by all queries below, instead of being repeated by each of them.
+// Instantiated in DualTree.cpp for the same trees as KdTree.
+template <uint32_t Dim, typename Coord>
+class DualTreeSearch
+{
+public:
+	typedef KdTree<Dim, Coord> Tree;
+	typedef typename Tree::Node Node;
+	typedef typename Tree::Distance Distance;
+
+	// The tree must outlive the search and not be rebuilt in between.
+	explicit DualTreeSearch(const Tree& tree);
+
+	// Same contract and results as KdTree::allNearestNeighbors: entry i refers to the point at position i in tree order,
+	// and ties between neighbors at the same distance go to the lowest position in both. Uses all available cores, and
+	// the output does not depend on how the work was scheduled.
+	void allNearestNeighbors(uint32_t* indices, double* distances);
+
+private:
+	struct NodeBox
+	{
+		Coord min[Dim];
+		Coord max[Dim];
+	};
+
+	const Tree& m_Tree;
+	// Tight bounding box of the points under each node, indexed like KdTree::m_Nodes.
+	std::vector<NodeBox> m_Boxes;
+	// For each node of the query tree, the largest squared distance from one of its points to its nearest neighbor
+	// candidate. Reference nodes farther than that from the query node cannot improve any of its points.
+	std::vector<Distance> m_Bounds;
+	// The squared distance from each point to its nearest neighbor candidate.
+	std::vector<Distance> m_DistSq;
+	uint32_t* m_Indices = nullptr;
+
+	uint32_t nodeIndex(const Node* node) const { return (uint32_t)(node - m_Tree.m_Nodes.data()); }
+	// Splits the top of the query tree into tasks, each searching one query subtree against the whole tree.
+	void spawnSearches(TaskPool& pool, TaskPool::Group& group, const Node* query, uint32_t depth);
+	void search(const Node* query, const Node* reference);
+	// Searches the children of reference, closest to the query node first.
+	void searchReferenceChildren(const Node* query, const Node* reference);
+	// Compares every point of the query leaf with every point of the reference leaf.
+	void searchLeaves(const Node* query, const Node* reference);
+
+	static Distance boxDistanceSq(const NodeBox& a, const NodeBox& b);
+};
+
+typedef DualTreeSearch<2, int32_t> DualTreeSearch2i;
+typedef DualTreeSearch<2, float> DualTreeSearch2f;
+typedef DualTreeSearch<3, float> DualTreeSearch3f;
\ No newline at end of file
@@ -0,0 +1,99 @@
+#pragma once
+
+#include "KdTree.h"
+#include "TaskPool.h"
+#include <memory>
+#include <vector>
+#include <cstdint>
+
+// A growing point set kept as a forest of static KdTrees, after Bentley and Saxe's logarithmic method.
+// Appended points go to a small buffer first. Once it is full, it is merged with levels 0 to j - 1 into a single tree
+// at the lowest empty level j, so that level i is either empty or holds bufferCapacity * 2^i points. Every point is
+// rebuilt O(log n) times, which makes appends amortized O(log^2 n), and every level keeps the static layout and its
+// fast queries. Merges run in the background on the global TaskPool: the buffer and the levels being merged are still
+// searched until the merged tree takes their place, at a later append() or flush().
+// Queries search every level and buffer with a shared bound, so a close candidate found in one prunes the others.
+// Instantiated in KdForest.cpp for the same trees as KdTree.
+template <uint32_t Dim, typename Coord>
+class KdForest
+{
+public:
+	typedef KdTree<Dim, Coord> Tree;
+	typedef typename Tree::Point Point;
+	typedef typename Tree::Distance Distance;
+
+	// Index reported when a point has no neighbor.
+	static const uint32_t InvalidIndex = Tree::InvalidIndex;
+	// The largest number of points a forest holds.
+	static const uint32_t MaxSize = UINT32_MAX >> 1;
+
+	// Levels are built with leaves of up to leafCapacity points, as by KdTree::build(). Queries scan the buffer
+	// point by point, so it is best kept small.
+	explicit KdForest(uint32_t leafCapacity = 8, uint32_t bufferCapacity = 256);
+	// Waits for the merge in flight, if any.
+	~KdForest();
+
+	KdForest(const KdForest&) = delete;
+	KdForest& operator=(const KdForest&) = delete;
+
+	// Adds a point and returns its id. Ids are given out in append order, from 0.
+	// Only waits for the previous merge if the buffer fills up again before it is done.
+	uint32_t append(const Point& p);
+	// Waits for the merge in flight, if any, and puts its tree in place.
+	void flush();
+	// The number of points appended.
+	uint32_t size() const { return m_Size; }
+	// The number of levels holding a tree.
+	uint32_t levelCount() const;
+
+	// The queries below work as their KdTree counterparts, but report points by id.
+	// The id of the point nearest to p, or InvalidIndex if there is none, and the distance to it. p itself, a point
+	// at its coordinates with its name, is left out as by KdTree::nearestNeighbor.
+	uint32_t nearestNeighbor(const Point& p, double& distance, double epsilon = 0.0) const;
+	// Finds the k points nearest to p, closest first, leaving out p itself. Both arrays must hold k entries.
+	// Returns how many were found.
+	uint32_t kNearestNeighbors(const Point& p, uint32_t k, uint32_t* ids, double* distances, double epsilon = 0.0) const;
+	// Appends to ids those of all points within distance r of p (boundary included), in no particular order.
+	void radiusSearch(const Point& p, double r, std::vector<uint32_t>& ids) const;
+
+private:
+	// A tree, along with the id of the point at each of its positions.
+	struct Component
+	{
+		Tree tree;
+		std::vector<uint32_t> ids;
+	};
+
+	uint32_t m_LeafCapacity;
+	uint32_t m_BufferCapacity;
+	uint32_t m_Size = 0;
+	// The points appended since the last merge started. They hold the last ids.
+	std::vector<Point> m_Buffer;
+	// Level i is either empty or holds m_BufferCapacity * 2^i points.
+	std::vector<std::unique_ptr<Component>> m_Levels;
+
+	// The merge in flight, if any. It reads the levels below m_MergeLevel and m_MergeBuffer, which hold the ids from
+	// m_MergeBufferBegin on, and builds m_Merged. Only finishMerge() touches them in the meantime.
+	bool m_Merging = false;
+	TaskPool::Group m_MergeTasks;
+	uint32_t m_MergeLevel = 0;
+	std::vector<Point> m_MergeBuffer;
+	uint32_t m_MergeBufferBegin = 0;
+	std::unique_ptr<Component> m_Merged;
+
+	// Moves the full buffer and the levels below the lowest empty one into a merge, and starts it.
+	void startMerge();
+	// Builds the tree of the merge in flight from the buffer and the given levels. Runs as a task.
+	void merge(const std::vector<const Component*>& sources);
+	// Waits for the merge in flight, then replaces its sources with its tree.
+	void finishMerge();
+	// Calls scan(points, firstId) for the buffer, and for the buffer being merged, if any.
+	template <typename Scan>
+	void scanBuffers(Scan scan) const;
+
+	static Distance squaredDistance(const Point& a, const Point& b);
+};
+
+typedef KdForest<2, int32_t> KdForest2i;
+typedef KdForest<2, float> KdForest2f;
+typedef KdForest<3, float> KdForest3f;
\ No newline at end of file
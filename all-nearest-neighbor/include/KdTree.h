@@ -5,69 +5,617 @@
 
 #include "Point.h"
 #include "AABB.h"
+#include "LeafScan.h"
+#include "MappedFile.h"
 #include <vector>
+#include <cstdint>
+#include <cstring>
+#include <cmath>
+#include <limits>
 
 #ifdef KDTREE_PARALLEL_BUILD
-#include <future>
+#include "TaskPool.h"
+#include <deque>
+#include <mutex>
 #endif
 
 
+// Nodes are stored in depth-first order in a single buffer: the left child of an inner node always
+// immediately follows it, while the right child is referenced by its offset from the parent.
+// Offsets are relative, so any subtree can be copied around as a block.
+template <typename Coord>
 struct KdTreeNode
 {
-	KdTreeNode* left = nullptr;
-	KdTreeNode* right = nullptr;
+	// Axis code marking a leaf.
+	static const uint32_t Leaf = 3;
+	// Largest count of points in a leaf, and largest offset to a right child.
+	static const uint32_t MaxPayload = UINT32_MAX >> 2;
 
 	union
 	{
 		// When a leaf. The starting index of the points contained by the node.
 		uint32_t begin;
 		// The value of the spliting plane.
-		int32_t value;
+		Coord value;
 	};
 
-	union
-	{
-		// When a leaf. The count of points contained by the node.
-		uint8_t count;
-		// The axis in which the node has been split.
-		// 0 - x
-		// 1 - y
-		uint8_t axis;
-	};
+	// The two lowest bits hold the axis in which the node has been split, or Leaf.
+	// 0 - x
+	// 1 - y
+	// 2 - z
+	// The remaining bits hold the count of points contained by the node when a leaf,
+	// and the offset to the right child otherwise.
+	uint32_t info;
 
 	inline bool isLeaf() const
 	{
-		return left == nullptr && right == nullptr;
+		return (info & 3) == Leaf;
+	}
+
+	inline uint32_t axis() const
+	{
+		return info & 3;
+	}
+
+	// When a leaf. The count of points contained by the node.
+	inline uint32_t count() const
+	{
+		return info >> 2;
+	}
+
+	// When an inner node. The distance, in nodes, from this node to its right child.
+	inline uint32_t rightOffset() const
+	{
+		return info >> 2;
+	}
+
+	inline const KdTreeNode* left() const
+	{
+		return this + 1;
+	}
+
+	inline const KdTreeNode* right() const
+	{
+		return this + rightOffset();
+	}
+
+	static inline KdTreeNode makeLeaf(uint32_t begin, uint32_t count)
+	{
+		KdTreeNode node;
+		node.begin = begin;
+		node.info = (count << 2) | Leaf;
+		return node;
+	}
+
+	static inline KdTreeNode makeInner(uint32_t axis, Coord value, uint32_t rightOffset)
+	{
+		KdTreeNode node;
+		node.value = value;
+		node.info = (rightOffset << 2) | axis;
+		return node;
 	}
 };
 
+static_assert(sizeof(KdTreeNode<int32_t>) == 8 && sizeof(KdTreeNode<float>) == 8, "KdTreeNode is expected to be packed in 8 bytes.");
+
+// Squared difference of two int32 values. Always exact: the difference is below 2^32, so its square fits in 64 bits.
+inline uint64_t squaredDifference(int32_t a, int32_t b)
+{
+	int64_t d = (int64_t)a - (int64_t)b;
+	uint64_t ud = (uint64_t)(d < 0 ? -d : d);
+	return ud * ud;
+}
+
+// Squared euclidean distance between two points, in exact integer arithmetic.
+// Saturates at UINT64_MAX if the sum does not fit in 64 bits, which requires points about 3 billion units apart.
+inline uint64_t squaredDistance(int32_t ax, int32_t ay, int32_t bx, int32_t by)
+{
+	uint64_t dx = squaredDifference(ax, bx);
+	uint64_t d = dx + squaredDifference(ay, by);
+	return d < dx ? UINT64_MAX : d;
+}
+
+// Distance arithmetic for each coordinate type.
+template <typename Coord>
+struct CoordTraits;
+
+// Integer coordinates: exact squared distances, which saturate instead of overflowing.
+template <>
+struct CoordTraits<int32_t>
+{
+	typedef uint64_t Distance;
+
+	static inline Distance squaredDifference(int32_t a, int32_t b) { return ::squaredDifference(a, b); }
+	static inline Distance add(Distance a, Distance b)
+	{
+		Distance sum = a + b;
+		return sum < a ? UINT64_MAX : sum;
+	}
+	static inline Distance maxDistance() { return UINT64_MAX; }
+	// The largest coordinate strictly below value.
+	static inline int32_t below(int32_t value) { return value - 1; }
+	// Unsigned key with the same order as the coordinates.
+	static inline uint32_t sortKey(int32_t value) { return (uint32_t)value ^ 0x80000000u; }
+	// The squared radius to search within, rounded down as distances are integers. False if nothing can be within r.
+	static inline bool radiusToSquared(double r, Distance& radiusSq)
+	{
+		if (!(r >= 0.0))
+			return false;
+
+		double sq = std::floor(r * r);
+		radiusSq = sq >= 18446744073709551616.0 ? UINT64_MAX : (uint64_t)sq;
+		return true;
+	}
+};
+
+// Floating point coordinates: single precision squared distances, which overflow to infinity.
+template <>
+struct CoordTraits<float>
+{
+	typedef float Distance;
+
+	static inline Distance squaredDifference(float a, float b) { return (a - b) * (a - b); }
+	static inline Distance add(Distance a, Distance b) { return a + b; }
+	static inline Distance maxDistance() { return std::numeric_limits<float>::infinity(); }
+	static inline float below(float value) { return std::nextafter(value, -std::numeric_limits<float>::infinity()); }
+	static inline uint32_t sortKey(float value)
+	{
+		uint32_t bits;
+		std::memcpy(&bits, &value, sizeof(bits));
+		return (bits & 0x80000000u) ? ~bits : bits | 0x80000000u;
+	}
+	static inline bool radiusToSquared(double r, Distance& radiusSq)
+	{
+		if (!(r >= 0.0))
+			return false;
+
+		radiusSq = (float)(r * r);
+		return true;
+	}
+};
+
+// Calls f(axis) for every axis, unrolled at compile time.
+template <uint32_t Dim>
+struct ForEachAxis
+{
+	template <typename F>
+	static inline void run(F&& f)
+	{
+		ForEachAxis<Dim - 1>::run(f);
+		f(Dim - 1);
+	}
+};
+
+template <>
+struct ForEachAxis<0>
+{
+	template <typename F>
+	static inline void run(F&&) {}
+};
+
+template <uint32_t Dim, typename Coord>
+class DualTreeSearch;
+template <uint32_t Dim, typename Coord>
+class KdForest;
+
+// A tree over points with Dim coordinates of type Coord. Definitions live in KdTree.cpp, which instantiates the
+// supported combinations: 2D int32 (KdTree2i), 2D float (KdTree2f) and 3D float (KdTree3f).
+template <uint32_t Dim, typename Coord>
 class KdTree
 {
+	static_assert(Dim >= 1 && Dim <= 3, "Nodes have room for three axes.");
+	static_assert(sizeof(Coord) == 4, "Nodes have room for 32-bit coordinates.");
+
 public:
+	typedef BasicPoint<Dim, Coord> Point;
+	typedef BasicAABB<Dim, Coord> AABB;
+	typedef KdTreeNode<Coord> Node;
+	// Type of the squared distances searches work in. See CoordTraits.
+	typedef typename CoordTraits<Coord>::Distance Distance;
+
+	// Index reported when a point has no neighbor (i.e. the tree holds a single point).
+	static const uint32_t InvalidIndex = UINT32_MAX;
+
+	// How build() finds the median of each node.
+	enum class BuildMode
+	{
+		// Linear time selection (nth_element) within each node.
+		Select,
+		// Sorts the points once per axis up front, then keeps every axis sorted by stable partitioning.
+		Presort
+	};
+
 	// The point set's AABB.
 	AABB m_AABB;
-	KdTreeNode* m_Root = nullptr;
+	// All nodes of the tree in a single contiguous buffer. The root is the first node. Empty if the tree has not been built.
+	// Refers to the snapshot file when loaded with loadSnapshot(), as do the point arrays below.
+	MappedArray<Node> m_Nodes;
 	
 private:
-	std::vector<Point> m_Points;
-	uint8_t m_LeafCapacity;
+	// Point coordinates in tree order, one tightly packed array per axis.
+	MappedArray<Coord> m_Coords[Dim];
+	// For each point in tree order, its index within the point set passed to build().
+	MappedArray<uint32_t> m_Ids;
+	// Point names, indexed by id, packed one after the other: the name of id i spans m_NameChars[m_NameOffsets[i],
+	// m_NameOffsets[i + 1]). Kept apart from the coordinates as queries never need them. Both empty if no point has a name.
+	MappedArray<char> m_NameChars;
+	MappedArray<uint64_t> m_NameOffsets;
+	uint32_t m_LeafCapacity = 0;
+	// The largest number of inner nodes on a path from the root to a leaf. Bounds the traversal stack of the queries.
+	uint32_t m_Depth = 0;
+	// The number of points in the tree. Equals size() until the first insert() or erase().
+	uint32_t m_PointCount = 0;
+	// For each id, the position of its point in tree order, or InvalidIndex once erased.
+	// Only kept from the first insert() or erase() on.
+	std::vector<uint32_t> m_Positions;
+	// Kernel used to search the leaves of 2D int32 trees, chosen for the running CPU once for all trees.
+	LeafScanFunction m_LeafScan = selectLeafScan();
+
+	// Compact point record sorted during the build, then transposed in place into the arrays m_Coords and m_Ids refer to.
+	struct BuildPoint
+	{
+		Coord coords[Dim];
+		uint32_t id;
+	};
+	std::vector<BuildPoint> m_BuildPoints;
+	// The caller's packed coordinates, when building over them in place instead of m_BuildPoints. See build().
+	Coord* m_BuildSource = nullptr;
+	uint32_t m_BuildSourceCount = 0;
+
+	BuildMode m_BuildMode;
+	// The leaf capacity of the nodes being built. Lower than m_LeafCapacity when rebuilding subtrees with spare positions.
+	uint32_t m_BuildLeafCapacity = 0;
+	// BuildMode::Presort only. For each axis, the indices into m_BuildPoints, or m_BuildSource, sorted along it within
+	// each node's range.
+	std::vector<uint32_t> m_Sorted[Dim];
+	// BuildMode::Presort only. Buffer for the stable partitions, used over the same range as the node being split.
+	std::vector<uint32_t> m_PartitionScratch;
+
+	// Nodes of a subtree, in depth-first order.
+	struct NodeBuffer
+	{
+		std::vector<Node> nodes;
+		// Whether some nodes are placeholders for subtrees built into other buffers.
+		bool hasPlaceholders = false;
+	};
 
 #ifdef KDTREE_PARALLEL_BUILD
-	std::vector<std::future<void>> asyncBuilds;
+	// Subtrees holding more points than this are split off into tasks.
+	static const uint32_t ParallelBuildCutoff = 1 << 15;
+	// Ranges of points larger than this are partitioned by several tasks.
+	static const uint32_t ParallelPartitionCutoff = 1 << 18;
+
+	// State shared by the build tasks. Only exists during build().
+	struct ParallelBuild
+	{
+		TaskPool& pool;
+		TaskPool::Group tasks;
+		// Buffers of the subtrees built as tasks. A deque, so they stay in place while more are added.
+		std::deque<NodeBuffer> buffers;
+		std::mutex buffersMutex;
+		// BuildMode::Select only. Buffer for the parallel partitions.
+		std::vector<BuildPoint> partitionScratch;
+
+		explicit ParallelBuild(TaskPool& taskPool) : pool(taskPool) {}
+	};
+	ParallelBuild* m_ParallelBuild = nullptr;
 #endif // KDTREE_PARALLEL_BUILD
 
 public:
 	KdTree() = default;
-	~KdTree();
 
-	// Creates an internal copy of the point set and builds the tree with it.
-	void build(uint8_t leafCapacity, const std::vector<Point>& points);
-	Point nearestNeighbor(Point p) const;
+	// Passed as the leaf capacity to build(), lets it pick one by timing queries on trees built from a sample of the points.
+	static const uint32_t AutoLeafCapacity = 0;
+
+	// Creates an internal copy of the point set and builds the tree with it. The tree's arrays are made out of that copy
+	// in place, so the point data is not held twice while building.
+	// Both build modes take O(n log n) time and produce the same tree, up to the order of points within leaves.
+	// Leaves hold up to leafCapacity points, or more where coincident points cannot be split apart.
+	void build(uint32_t leafCapacity, const std::vector<Point>& points, BuildMode mode = BuildMode::Select);
+	// Like the above, but frees the points once their coordinates and names have been packed. They are still held in
+	// full next to the packed copy while it is made, but no longer during the build itself.
+	void build(uint32_t leafCapacity, std::vector<Point>&& points, BuildMode mode = BuildMode::Select);
+	// Like the above, over count points stored by the caller as packed coordinates: point i, the one with id i, has
+	// coords[i * Dim] to coords[i * Dim + Dim - 1], as in a binary point file read into memory. Nothing is copied:
+	// the tree is built as BuildMode::Presort, which only reads the points where they are, then the buffer is
+	// rearranged in place into the tree's coordinate arrays, one per axis in tree order, which the tree refers to
+	// from then on. The buffer must therefore be writable, and outlive the tree or stay unchanged until the tree is
+	// rebuilt or first updated, as a snapshot's file does. The points have no names.
+	void build(uint32_t leafCapacity, Coord* coords, uint32_t count);
+	// Like the above, over points stored column-wise, as read by readPointFile(). Point i is the one with id i.
+	void build(uint32_t leafCapacity, const BasicPointArrays<Dim, Coord>& points, BuildMode mode = BuildMode::Select);
+	// Like the above, but takes the names over without copying them, and frees each axis of coordinates as soon as it
+	// has been packed. The points are left empty.
+	void build(uint32_t leafCapacity, BasicPointArrays<Dim, Coord>&& points, BuildMode mode = BuildMode::Select);
+	// The leaf capacity the tree was built with, as picked by build() when given AutoLeafCapacity.
+	uint32_t leafCapacity() const { return m_LeafCapacity; }
+
+	// Adds a point to a built tree and returns its id, as if it had been appended to the point set passed to build().
+	// Every leaf is followed by spare positions, which the points inserted into it fill. Once they run out, the
+	// smallest enclosing subtree with enough spare positions is rebuilt in place, spreading them evenly over its
+	// new leaves, as in a packed memory array. The whole tree is rebuilt with twice as many positions as points when
+	// it gets too full. Updates take amortized O(log^2 n) point moves, and queries work as usual in between.
+	uint32_t insert(const Point& p);
+	// Removes the point with the given id, if still in the tree. The last point of its leaf takes its position, which
+	// changes. Subtrees left too sparse are rebuilt as by insert(), and the whole tree shrinks once mostly spare.
+	bool erase(uint32_t id);
+	// The number of points in the tree.
+	uint32_t pointCount() const { return m_PointCount; }
+
+	// Writes the tree to a binary snapshot file: its nodes, its point arrays in tree order and its bounds, laid out as
+	// in memory, plus the names if any. Throws if the tree is empty or the file cannot be written.
+	void saveSnapshot(const std::string& path) const;
+	// Replaces the tree with one saved by saveSnapshot(), mapping the file instead of reading it. Nothing is parsed
+	// nor rebuilt, and nothing is copied, names included. Only the nodes, ids and name offsets are read once, to check
+	// that they stay within bounds. Coordinates and names are read from disk as queries reach them, and processes
+	// loading the same file share them. The file must stay unchanged while the tree refers to it, which it does until
+	// rebuilt or first updated. Throws if the file is not a snapshot of this version of a tree with the same
+	// dimensions and coordinate type, or if it is damaged.
+	void loadSnapshot(const std::string& path);
+
+	// The nearest neighbor queries below take an optional epsilon >= 0 that trades accuracy for speed. With epsilon > 0,
+	// subtrees that cannot hold a point closer than 1 / (1 + epsilon) times the current candidate are skipped. Every
+	// reported distance is then at most (1 + epsilon) times the true one: the nearest neighbor's, or for the k nearest
+	// neighbors, that of the true neighbor of the same rank. The default of 0 gives exact results.
+	Point nearestNeighbor(const Point& p, double epsilon = 0.0) const;
+
+	// Finds the nearest neighbor of every point in the tree, as nearestNeighborOf does, using all available cores.
+	// Both arrays must hold size() entries. Entry i refers to the point at position i in tree order: indices[i] receives
+	// the position of its nearest neighbor (InvalidIndex if there is none) and distances[i] the distance to it.
+	// The output does not depend on the number of threads or on how the work was scheduled.
+	void allNearestNeighbors(uint32_t* indices, double* distances, double epsilon = 0.0) const;
+	// The position, in tree order, of the nearest neighbor of the point at the given position, or InvalidIndex if
+	// there is none. distance receives the distance to it. Only the point itself is left out: other points at the
+	// same coordinates are neighbors at distance zero, whatever their name.
+	uint32_t nearestNeighborOf(uint32_t index, double& distance, double epsilon = 0.0) const;
+	// Finds the nearest neighbor of each of count queries, using all available cores. indices[i] and distances[i]
+	// receive the position, in tree order, of the nearest neighbor of queries[i] and the distance to it, as in
+	// allNearestNeighbors. The queries are run in Z-order, so that consecutive ones walk through mostly the same
+	// nodes and leaves while they are still in cache, whatever order they come in.
+	void nearestNeighbors(const Point* queries, uint32_t count, uint32_t* indices, double* distances, double epsilon = 0.0) const;
+
+	// Finds the k points nearest to p, closest first. Both arrays must hold k entries and receive the positions
+	// of the neighbors, in tree order, and their distances. Returns how many were found, which is less than k only
+	// if the tree holds fewer points. Does not allocate for k up to KnnStackCapacity.
+	uint32_t kNearestNeighbors(const Point& p, uint32_t k, uint32_t* indices, double* distances, double epsilon = 0.0) const;
+	// Like kNearestNeighbors, for the point at the given position. Leaves out the point itself as nearestNeighborOf does.
+	uint32_t kNearestNeighborsOf(uint32_t index, uint32_t k, uint32_t* indices, double* distances, double epsilon = 0.0) const;
+	// Finds the k nearest neighbors of every point in the tree, using all available cores.
+	// Both arrays must hold size() * k entries: row i, made of entries [i * k, (i + 1) * k), refers to the point at
+	// position i in tree order and is filled as by kNearestNeighborsOf. Unused entries are set to InvalidIndex.
+	void allKNearestNeighbors(uint32_t k, uint32_t* indices, double* distances, double epsilon = 0.0) const;
+	static const uint32_t KnnStackCapacity = 64;
+
+	// Appends to indices the positions, in tree order, of all points within distance r of p (boundary included),
+	// in no particular order. Points at p itself are reported too.
+	void radiusSearch(const Point& p, double r, std::vector<uint32_t>& indices) const;
+	// The number of points radiusSearch would report.
+	uint32_t radiusCount(const Point& p, double r) const;
+	// Runs radiusSearch for each query, using all available cores. The results are stored in CSR form: offsets
+	// receives queryCount + 1 entries and the neighbors of query i are indices[offsets[i]] to indices[offsets[i + 1] - 1].
+	void radiusSearch(const Point* queries, uint32_t queryCount, double r, std::vector<uint64_t>& offsets, std::vector<uint32_t>& indices) const;
+
+	// Appends to indices the positions, in tree order, of all points inside the box, bounds included, in no
+	// particular order. Takes O(sqrt(n) + k) time for k reported points.
+	void rangeQuery(const AABB& box, std::vector<uint32_t>& indices) const;
+	// The number of points rangeQuery would report.
+	uint32_t rangeCount(const AABB& box) const;
+
+	// The number of positions in tree order. Once the tree has been updated, some are spare and hold no point: their
+	// id is InvalidIndex, and the queries filling one entry per position set theirs as for a point without neighbor.
+	uint32_t size() const { return (uint32_t)m_Ids.size(); }
+	// The coordinates of all points along the given axis, in tree order.
+	const Coord* coords(uint32_t axis) const { return m_Coords[axis].data(); }
+	// The index, within the point set passed to build(), of the point at the given position in tree order.
+	// Points added by insert() follow those passed to build(), in order.
+	uint32_t id(uint32_t index) const { return m_Ids[index]; }
+	// The name of the point with the given id.
+	std::string name(uint32_t id) const;
+	// The same without copying it: the name's length characters, which are not null terminated, start at the pointer.
+	const char* name(uint32_t id, size_t& length) const;
+	// The point at the given position in tree order, name included.
+	Point point(uint32_t index) const;
 
 private:
+	// First half of build(): picks the leaf capacity and fills m_BuildPoints and m_AABB with the count points, whose
+	// coordinates coordAt(i, axis) returns. Returns false, leaving the tree as is, if there are none. Only sets m_AABB
+	// unless copy, for points built over in place or packed by the caller.
+	template <typename CoordAt>
+	bool loadBuildPoints(uint32_t leafCapacity, size_t count, CoordAt coordAt, BuildMode mode, bool copy = true);
+	// Sets the names of the count points being built. nameAt(i, length) returns the name of the point with id i and
+	// sets length to its size. Keeps none if all are empty.
+	template <typename NameAt>
+	void loadNames(uint32_t count, NameAt nameAt);
+	// Appends the name of the next id given out.
+	void appendName(const std::string& name);
+	// Second half of build(): builds the tree over m_BuildPoints, or m_BuildSource, and turns them into the packed arrays.
+	void buildLoadedPoints();
+	// Rearranges count records of fieldCount 32-bit words, one after the other, into one array per field, within the
+	// same memory.
+	static void transposeWords(char* words, size_t count, size_t fieldCount);
+	// Coordinate of the point with index i along the axis, during presorted builds.
+	Coord presortedCoord(uint32_t i, uint32_t axis) const { return m_BuildSource ? m_BuildSource[(size_t)i * Dim + axis] : m_BuildPoints[i].coords[axis]; }
+	// Builds a tree over m_BuildPoints into nodes, with the given AABB for the root and leaves of up to leafCapacity
+	// points. Leaves refer to the points by their position in tree order, see builtPoint(). Sets up the presorted
+	// arrays and the parallel build as needed.
+	void buildNodes(const AABB& aabb, uint32_t leafCapacity, std::vector<Node>& nodes);
+	// The point at the given position in tree order, once buildNodes() is done.
+	const BuildPoint& builtPoint(uint32_t index) const;
+	// Frees the buffers used by buildNodes().
+	void releaseBuildState();
 	// Builds the tree recursively. The range [begin, end) represent the points contained within the node. 
 	// AABB is the bound containing all points within the range [begin, end).
-	KdTreeNode* buildRecursive(uint32_t begin, uint32_t end, AABB aabb, int depth);
-	void nearestNeighborRecursive(const KdTreeNode* node, Point& p, Point& nearest, double& dist) const;
-	void freeNodes(KdTreeNode* node);
-};
\ No newline at end of file
+	// Nodes are appended to the given buffer. Returns the index of the subtree's root within it.
+	uint32_t buildRecursive(uint32_t begin, uint32_t end, AABB aabb, NodeBuffer& buffer);
+	// Splits the points in [begin, end) along the given axis, around the median. Points with a coordinate below
+	// value end up in [begin, mid), the others in [mid, end). Returns false, leaving the range as is, if all points
+	// share the same coordinate along the axis.
+	bool splitSelect(uint32_t begin, uint32_t end, uint32_t axis, uint32_t& mid, Coord& value);
+	bool splitPresorted(uint32_t begin, uint32_t end, uint32_t axis, uint32_t& mid, Coord& value);
+	// Moves the points for which pred holds to the front of [begin, end). Returns the end of that part.
+	// Large ranges are partitioned in parallel, stably, during parallel builds.
+	template <typename Predicate>
+	uint32_t partitionBuildPoints(uint32_t begin, uint32_t end, Predicate pred);
+	// Like nth_element: puts the nth point, along the axis, in its sorted position, with no greater point before it
+	// and no smaller point after it. Large ranges are narrowed down in parallel during parallel builds.
+	void selectBuildPoint(uint32_t begin, uint32_t end, uint32_t nth, uint32_t axis);
+	// Depth-first traversal shared by the nearest neighbor searches, nearest side first. Iterative: the far children
+	// still to be searched wait on an explicit stack along with the squared distance from p to their region, and are
+	// skipped once that distance is beyond bound(), or reaches it unless reachTies. Calls scanLeaf(leaf) for every leaf
+	// reached. pruneScale is (1 + epsilon)^2, see pruneScaleFor().
+	template <typename ScanLeaf, typename Bound>
+	void nearestFirstSearch(const Point& p, double pruneScale, bool reachTies, ScanLeaf& scanLeaf, Bound& bound) const;
+	// Searches in squared distances. distSq is the squared distance to the nearest point found so far. When exact, ties
+	// go to the lowest position, as in DualTreeSearch.
+	// self is the position of the query when it is a point of the tree, InvalidIndex otherwise. See isQuery().
+	void nearestNeighborSearch(const Point& p, uint32_t self, uint32_t& nearest, Distance& distSq, double pruneScale) const;
+	// Updates distSq and nearest with the point of [begin, end) closest to q, as the LeafScan.h kernels do, including
+	// leaving out points at q and breaking ties by lowest position. Uses the kernels themselves for 2D int32 trees.
+	inline bool scanPoints(uint32_t begin, uint32_t end, const Coord* q, Distance& distSq, uint32_t& nearest) const
+	{
+		bool foundQuery = false;
+		for (uint32_t i = begin; i < end; i++)
+		{
+			Distance d = squaredDistanceTo(i, q);
+			if (d == 0 && isAt(i, q))
+				foundQuery = true;
+			else if (d < distSq)
+			{
+				distSq = d;
+				nearest = i;
+			}
+			else if (d == distSq && i < nearest && d != CoordTraits<Coord>::maxDistance())
+				nearest = i;
+		}
+		return foundQuery;
+	}
+	// Squared distance from the point at the given position to q. Sums the axes in order, as all searches do.
+	inline Distance squaredDistanceTo(uint32_t index, const Coord* q) const
+	{
+		Distance distSq = CoordTraits<Coord>::squaredDifference(m_Coords[0][index], q[0]);
+		for (uint32_t axis = 1; axis < Dim; axis++)
+			distSq = CoordTraits<Coord>::add(distSq, CoordTraits<Coord>::squaredDifference(m_Coords[axis][index], q[axis]));
+		return distSq;
+	}
+	// Whether the point at the given position lies at q.
+	inline bool isAt(uint32_t index, const Coord* q) const
+	{
+		for (uint32_t axis = 0; axis < Dim; axis++)
+		{
+			if (m_Coords[axis][index] != q[axis])
+				return false;
+		}
+		return true;
+	}
+	// The point at the given position, without its name. Queries from within the tree never need it.
+	inline Point location(uint32_t index) const
+	{
+		Point p;
+		for (uint32_t axis = 0; axis < Dim; axis++)
+			p[axis] = m_Coords[axis][index];
+		return p;
+	}
+	// The best candidates of a k nearest neighbors search.
+	struct KnnCandidates;
+	uint32_t kNearestNeighborsQuery(const Point& p, uint32_t self, uint32_t k, uint32_t* indices, double* distances, double epsilon) const;
+	void kNearestNeighborsSearch(const Point& p, uint32_t self, KnnCandidates& candidates, double pruneScale) const;
+	// The factor applied to squared plane distances when pruning with the given epsilon. Throws if epsilon is negative.
+	static double pruneScaleFor(double epsilon);
+	// Reports the points of the subtree that lie within the region by calling emit(begin, end) for ranges of positions.
+	// bounds is the AABB of the subtree. Subtrees the region contains entirely are reported whole, with no per-point
+	// tests, so only the nodes along the region's boundary are searched point by point.
+	template <typename Region, typename Emit>
+	void regionSearchRecursive(const Node* node, const AABB& bounds, const Region& region, Emit& emit) const;
+	// The positions of the points held by the subtree, [begin, end). Spare positions in between are included.
+	static void subtreeRange(const Node* node, uint32_t& begin, uint32_t& end);
+	// Calls emit(begin, end) for the positions of the points held by the subtree, skipping spare positions.
+	template <typename Emit>
+	void emitSubtree(const Node* node, Emit& emit) const;
+	// Whether the point at the given position is p itself. Only compares names when the coordinates match.
+	inline bool isSamePoint(uint32_t index, const Point& p) const;
+	// Whether the point at the given position, which lies at p's coordinates, is the query and must be left out.
+	// Queries from within the tree are recognized by position, others with isSamePoint().
+	inline bool isQuery(uint32_t index, const Point& p, uint32_t self) const;
+
+	friend class DualTreeSearch<Dim, Coord>;
+	friend class KdForest<Dim, Coord>;
+
+#ifdef KDTREE_PARALLEL_BUILD
+	// Appends the nodes of the buffer to out, recursively replacing placeholders with the subtrees they stand for.
+	void spliceNodeBuffer(const NodeBuffer& buffer, std::vector<Node>& out);
+#endif
+
+	// A subtree on the path to a leaf, along with the nodes and positions it spans, spare ones included.
+	struct PathEntry
+	{
+		uint32_t node;
+		uint32_t nodeEnd;
+		uint32_t begin;
+		uint32_t end;
+	};
+	// The subtrees from the root to the leaf whose region holds q. Only the nodes they span are filled in.
+	void findPath(const Coord* q, std::vector<PathEntry>& path) const;
+	// Fills in the positions spanned by the subtrees on the path.
+	void findPathPositions(std::vector<PathEntry>& path) const;
+	// The number of points held by the nodes [begin, end).
+	uint32_t countPoints(uint32_t begin, uint32_t end) const;
+	// Starts keeping m_Positions, for ids below idCount.
+	void trackPositions(uint32_t idCount);
+	// Rebuilds the subtree in place with its points, plus the one at extra with id extraId when given, spread over
+	// its positions. Returns false, leaving it untouched, if the new subtree needs more nodes than the old one spans.
+	// Rebuilding the root always succeeds, and spreads the points over positionCount positions instead.
+	bool rebuildSubtree(const PathEntry& entry, uint32_t depth, const Coord* extra, uint32_t extraId, uint32_t positionCount);
+
+	// Builds trees with a range of leaf capacities over a sample of the points and returns the one with the fastest queries.
+	template <typename CoordAt>
+	static uint32_t tuneLeafCapacity(uint32_t count, CoordAt coordAt, BuildMode mode);
+	// See m_Depth.
+	static uint32_t treeDepth(const Node* nodes, size_t count);
+	// Traversals keep their stack in a local array for trees up to this deep, and allocate one for deeper ones.
+	static const uint32_t TraversalStackCapacity = 64;
+
+	// The number of nodes of a tree over count points when every split lands exactly on the median.
+	// Used to size the node buffer up front.
+	static uint32_t balancedNodeCount(uint32_t count, uint32_t leafCapacity);
+};
+
+// The k best candidates found so far, sorted by increasing distance. Ties keep the order they were found in.
+// Defined here so that searches over several trees can share one, see KdForest.
+template <uint32_t Dim, typename Coord>
+struct KdTree<Dim, Coord>::KnnCandidates
+{
+	Distance* distSq;
+	uint32_t* indices;
+	uint32_t k;
+	uint32_t count;
+
+	// Only points closer than this can still make it in.
+	inline Distance bound() const
+	{
+		return count < k ? CoordTraits<Coord>::maxDistance() : distSq[k - 1];
+	}
+
+	// Insertion into a sorted array. Cheaper than a heap for the small k this is meant for, and leaves the result sorted.
+	inline void insert(Distance d, uint32_t index)
+	{
+		uint32_t i = count < k ? count++ : k - 1;
+		for (; i > 0 && distSq[i - 1] > d; i--)
+		{
+			distSq[i] = distSq[i - 1];
+			indices[i] = indices[i - 1];
+		}
+		distSq[i] = d;
+		indices[i] = index;
+	}
+};
+
+// 2D int32 trees search their leaves with the vectorized kernels.
+template <>
+inline bool KdTree<2, int32_t>::scanPoints(uint32_t begin, uint32_t end, const int32_t* q, uint64_t& distSq, uint32_t& nearest) const
+{
+	return m_LeafScan(m_Coords[0].data(), m_Coords[1].data(), begin, end, q[0], q[1], distSq, nearest);
+}
+
+typedef KdTree<2, int32_t> KdTree2i;
+typedef KdTree<2, float> KdTree2f;
+typedef KdTree<3, float> KdTree3f;
\ No newline at end of file
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <cstdint>
+
+// Leaf scan kernels. They search the points [begin, end) of the packed coordinate arrays for the one
+// closest to the query (qx, qy) and update bestDistSq and bestIndex if it is strictly closer than bestDistSq, or
+// as close with a lower index. Among points at the same distance the lowest index wins, so all kernels give the same
+// result, and so do searches reaching the leaves in any order. Saturated distances never tie.
+//
+// Points lying at the query's coordinates are left out, as they may be the query itself.
+// Returns whether the range holds any such point.
+typedef bool (*LeafScanFunction)(const int32_t* xs, const int32_t* ys, uint32_t begin, uint32_t end, int32_t qx, int32_t qy, uint64_t& bestDistSq, uint32_t& bestIndex);
+
+bool leafScanScalar(const int32_t* xs, const int32_t* ys, uint32_t begin, uint32_t end, int32_t qx, int32_t qy, uint64_t& bestDistSq, uint32_t& bestIndex);
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define LEAFSCAN_X86
+
+// Computes 8 squared distances per iteration. Requires a CPU with AVX2.
+bool leafScanAvx2(const int32_t* xs, const int32_t* ys, uint32_t begin, uint32_t end, int32_t qx, int32_t qy, uint64_t& bestDistSq, uint32_t& bestIndex);
+#endif
+
+bool cpuSupportsAvx2();
+
+// The fastest kernel the running CPU supports, chosen on the first call.
+LeafScanFunction selectLeafScan();
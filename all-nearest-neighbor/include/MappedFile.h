@@ -0,0 +1,141 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+// A whole file mapped read-only into memory. Pages are only read from disk once touched, and are shared with every
+// other process mapping the same file. The file must not change while mapped.
+class MappedFile
+{
+public:
+	// Throws if the file cannot be opened or mapped.
+	explicit MappedFile(const std::string& path);
+	~MappedFile();
+
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+
+	const char* data() const { return m_Data; }
+	size_t size() const { return m_Size; }
+
+private:
+	const char* m_Data = nullptr;
+	size_t m_Size = 0;
+#ifdef _WIN32
+	void* m_Mapping = nullptr;
+#endif
+};
+
+// An array holding either elements of its own, or referring to elements within a MappedFile, which it keeps mapped, or
+// within any other buffer shared by several arrays, which it keeps alive. Reading is the same either way. The first
+// access that may write copies mapped elements into an array of its own.
+template <typename T>
+class MappedArray
+{
+public:
+	MappedArray() = default;
+	MappedArray(const MappedArray& other) { *this = other; }
+	MappedArray(MappedArray&& other) { *this = std::move(other); }
+
+	MappedArray& operator=(const MappedArray& other)
+	{
+		m_Owned = other.m_Owned;
+		m_Owner = other.m_Owner;
+		m_Data = m_Owner ? other.m_Data : m_Owned.data();
+		m_Size = other.m_Size;
+		return *this;
+	}
+
+	MappedArray& operator=(MappedArray&& other)
+	{
+		m_Owned = std::move(other.m_Owned);
+		m_Owner = std::move(other.m_Owner);
+		m_Data = m_Owner ? other.m_Data : m_Owned.data();
+		m_Size = other.m_Size;
+		other.clear();
+		return *this;
+	}
+
+	// Refers to count elements starting at data, which lies within owner: a MappedFile, or a buffer of elements.
+	void map(std::shared_ptr<const void> owner, const T* data, size_t count)
+	{
+		m_Owned.clear();
+		m_Owner = std::move(owner);
+		m_Data = data;
+		m_Size = count;
+	}
+
+	// Takes the elements over.
+	void assign(std::vector<T>&& elements)
+	{
+		m_Owner.reset();
+		m_Owned = std::move(elements);
+		update();
+	}
+
+	size_t size() const { return m_Size; }
+	bool empty() const { return m_Size == 0; }
+	const T* data() const { return m_Data; }
+	const T& operator[](size_t index) const { return m_Data[index]; }
+	const T* begin() const { return m_Data; }
+	const T* end() const { return m_Data + m_Size; }
+
+	T* data()
+	{
+		own();
+		return m_Owned.data();
+	}
+	T& operator[](size_t index) { return data()[index]; }
+	T* begin() { return data(); }
+	T* end() { return data() + m_Size; }
+
+	// Appends count elements, which must not lie within the array.
+	void append(const T* elements, size_t count)
+	{
+		own();
+		m_Owned.insert(m_Owned.end(), elements, elements + count);
+		update();
+	}
+
+	void resize(size_t count)
+	{
+		own();
+		m_Owned.resize(count);
+		update();
+	}
+
+	// Drops mapped elements without copying them.
+	void clear()
+	{
+		m_Owner.reset();
+		m_Owned.clear();
+		update();
+	}
+
+private:
+	std::vector<T> m_Owned;
+	// What the elements lie within when they are not in m_Owned.
+	std::shared_ptr<const void> m_Owner;
+	// The elements, in m_Owned or in m_Owner.
+	const T* m_Data = nullptr;
+	size_t m_Size = 0;
+
+	void own()
+	{
+		if (!m_Owner)
+			return;
+
+		m_Owned.assign(m_Data, m_Data + m_Size);
+		m_Owner.reset();
+		update();
+	}
+
+	void update()
+	{
+		m_Data = m_Owned.data();
+		m_Size = m_Owned.size();
+	}
+};
\ No newline at end of file
@@ -1,45 +1,88 @@
 #pragma once
 #include <string>
+#include <vector>
 #include <fstream>
 #include <cmath>
+#include <cstdint>
+#include <type_traits>
 
-struct Point
+// A named point with Dim coordinates of type Coord.
+template <uint32_t Dim, typename Coord>
+struct BasicPoint
 {
-	int32_t m_x = 0;
-	int32_t m_y = 0;
+	static const uint32_t Dimensions = Dim;
+	typedef Coord CoordType;
+
+	Coord m_coords[Dim] = {};
 	std::string m_name;
 
-	Point() = default;
+	BasicPoint() = default;
 
-	Point(int32_t x, int32_t y);
+	// Takes exactly one coordinate per dimension.
+	template <typename... Coords, typename = typename std::enable_if<sizeof...(Coords) == Dim>::type>
+	BasicPoint(Coords... coords) : m_coords{ static_cast<Coord>(coords)... } {}
 
 	inline double squaredMagnitude() const;
 	inline double magnitude() const;
 
-	bool operator==(const Point& other) const;
-	inline int32_t& operator[](std::size_t idx);
-	inline Point operator-(const Point& other) const;
+	bool operator==(const BasicPoint& other) const;
+	inline Coord& operator[](std::size_t idx) { return m_coords[idx]; }
+	inline Coord operator[](std::size_t idx) const { return m_coords[idx]; }
+	inline BasicPoint operator-(const BasicPoint& other) const;
 };
 
-std::istream& operator >> (std::istream& stream, Point& point);
-std::ostream& operator << (std::ostream& stream, const Point& point);
+typedef BasicPoint<2, int32_t> Point;
+typedef BasicPoint<2, float> Point2f;
+typedef BasicPoint<3, float> Point3f;
 
-int32_t& Point::operator[](std::size_t idx)
+// A set of points stored column-wise: the coordinates in one array per axis, and the names packed one after the
+// other in a single buffer. See readPointFile() in PointFile.h.
+template <uint32_t Dim, typename Coord>
+struct BasicPointArrays
 {
-	return idx == 0 ? m_x : m_y;
-}
+	std::vector<Coord> coords[Dim];
+	std::vector<char> names;
+	// The name of point i spans names[nameOffsets[i], nameOffsets[i + 1]). Holds one more entry than there are points.
+	std::vector<uint64_t> nameOffsets;
+
+	uint32_t size() const { return (uint32_t)coords[0].size(); }
+	std::string name(uint32_t index) const
+	{
+		return std::string(names.data() + nameOffsets[index], (size_t)(nameOffsets[index + 1] - nameOffsets[index]));
+	}
+};
+
+typedef BasicPointArrays<2, int32_t> PointArrays;
+typedef BasicPointArrays<2, float> PointArrays2f;
+typedef BasicPointArrays<3, float> PointArrays3f;
+
+// Reads and writes points as "name ( x , y )", with as many coordinates as the point has dimensions.
+// Reading throws std::out_of_range for coordinates that do not fit Coord.
+template <uint32_t Dim, typename Coord>
+std::istream& operator >> (std::istream& stream, BasicPoint<Dim, Coord>& point);
+template <uint32_t Dim, typename Coord>
+std::ostream& operator << (std::ostream& stream, const BasicPoint<Dim, Coord>& point);
 
-Point Point::operator-(const Point& other) const
+template <uint32_t Dim, typename Coord>
+BasicPoint<Dim, Coord> BasicPoint<Dim, Coord>::operator-(const BasicPoint& other) const
 {
-	return Point(m_x - other.m_x, m_y - other.m_y);
+	BasicPoint result;
+	for (uint32_t i = 0; i < Dim; i++)
+		result.m_coords[i] = m_coords[i] - other.m_coords[i];
+	return result;
 }
 
-double Point::magnitude() const
+template <uint32_t Dim, typename Coord>
+double BasicPoint<Dim, Coord>::magnitude() const
 {
 	return std::sqrt(squaredMagnitude());
 }
 
-double Point::squaredMagnitude() const
+template <uint32_t Dim, typename Coord>
+double BasicPoint<Dim, Coord>::squaredMagnitude() const
 {
-	return static_cast<double>(m_x) * static_cast<double>(m_x) + static_cast<double>(m_y) * static_cast<double>(m_y);
+	double sum = 0.0;
+	for (uint32_t i = 0; i < Dim; i++)
+		sum += static_cast<double>(m_coords[i]) * static_cast<double>(m_coords[i]);
+	return sum;
 }
\ No newline at end of file
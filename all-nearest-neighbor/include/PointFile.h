@@ -0,0 +1,24 @@
+#pragma once
+
+#include "Point.h"
+#include <string>
+#include <cstddef>
+#include <cstdint>
+
+// Reads a file of points written as "name ( x , y )", with as many coordinates as the points have dimensions and
+// one point per line, into points. Spaces around the brackets and commas are optional, and blank lines are skipped.
+// Unlike operator >>, the file is mapped into memory and cut into chunks at line breaks, which are parsed in parallel
+// on the global TaskPool, straight from the mapping and without allocating anything per point.
+// Throws, giving the line, if the file cannot be read or a line is not a point.
+// Instantiated in PointFile.cpp for the same points as KdTree.
+template <uint32_t Dim, typename Coord>
+void readPointFile(const std::string& path, BasicPointArrays<Dim, Coord>& points);
+
+// Parses the points of the text [begin, end), which starts at the beginning of a line, as readPointFile() does, and
+// appends them to points. Returns the number of line breaks passed. Stops at the first line that is not a point, with
+// error set to what is wrong with it, and the count returned that of the lines before it. error is nullptr otherwise.
+template <uint32_t Dim, typename Coord>
+uint64_t parsePoints(const char* begin, const char* end, BasicPointArrays<Dim, Coord>& points, const char*& error);
+// The end of the chunk of about size bytes of text starting at begin, right after a line break so that no line is
+// split between two chunks. end if the text ends first.
+const char* pointChunkEnd(const char* begin, const char* end, size_t size);
\ No newline at end of file
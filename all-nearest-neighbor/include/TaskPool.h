@@ -0,0 +1,82 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// A fork-join thread pool with work stealing.
+// Every worker owns a queue: it runs its own tasks last in, first out, and steals from the front of the
+// others' queues when it runs out. Threads outside the pool share one extra queue. Threads waiting for
+// a group of tasks run queued tasks in the meantime, so tasks can wait for tasks they spawned, and sleep once there
+// are none left to run.
+class TaskPool
+{
+public:
+	// Tracks the tasks of a fork-join section.
+	struct Group
+	{
+		std::atomic<uint32_t> pending;
+		// The first exception thrown by one of the tasks, rethrown by wait().
+		std::exception_ptr error;
+		std::mutex errorMutex;
+
+		Group() : pending(0) {}
+	};
+
+	// Starts workerCount threads. Threads calling wait() take part as well.
+	explicit TaskPool(unsigned workerCount);
+	~TaskPool();
+
+	TaskPool(const TaskPool&) = delete;
+	TaskPool& operator=(const TaskPool&) = delete;
+
+	// The process-wide pool, with one worker per hardware thread besides the caller's.
+	static TaskPool& global();
+
+	// The number of threads running tasks, counting one caller.
+	unsigned threadCount() const { return (unsigned)m_Workers.size() + 1; }
+
+	// Queues a task belonging to the group.
+	void run(Group& group, std::function<void()> task);
+	// Runs queued tasks until all tasks of the group are done. Then rethrows the first exception any of them threw,
+	// if any. The other tasks still run to completion.
+	void wait(Group& group);
+	// Calls fn(i) for every i in [0, count), each as a separate task, and waits for all of them as wait() does.
+	void parallelFor(uint32_t count, const std::function<void(uint32_t)>& fn);
+
+private:
+	struct Task
+	{
+		std::function<void()> fn;
+		Group* group;
+	};
+
+	struct Queue
+	{
+		std::mutex mutex;
+		std::deque<Task> tasks;
+	};
+
+	// One queue per worker, followed by the one shared by outside threads.
+	std::vector<std::unique_ptr<Queue>> m_Queues;
+	std::vector<std::thread> m_Workers;
+
+	// Idle workers sleep until tasks are queued, and waiting threads until then or until their group is done.
+	std::mutex m_SleepMutex;
+	std::condition_variable m_WakeUp;
+	std::atomic<uint32_t> m_Queued;
+	bool m_Stop = false;
+
+	// The queue of the calling thread.
+	unsigned ownQueue() const;
+	// Runs one task, from the given queue if it has any, stolen from another one otherwise.
+	bool tryRunTask(unsigned queue);
+	void workerLoop(unsigned index);
+};
@@ -0,0 +1,198 @@
+#include "../include/DualTree.h"
+#include "../include/TaskPool.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+
+template <uint32_t Dim, typename Coord>
+DualTreeSearch<Dim, Coord>::DualTreeSearch(const Tree& tree)
+	: m_Tree(tree)
+{
+	const MappedArray<Node>& nodes = tree.m_Nodes;
+	m_Boxes.resize(nodes.size());
+
+	// Children always come after their parent, so walking the nodes backwards sees them first.
+	for (size_t i = nodes.size(); i-- > 0;)
+	{
+		const Node& node = nodes[i];
+		NodeBox& box = m_Boxes[i];
+
+		if (node.isLeaf())
+		{
+			for (uint32_t axis = 0; axis < Dim; axis++)
+			{
+				const Coord* coords = tree.coords(axis);
+				box.min[axis] = std::numeric_limits<Coord>::max();
+				box.max[axis] = std::numeric_limits<Coord>::lowest();
+				for (uint32_t j = node.begin; j < node.begin + node.count(); j++)
+				{
+					box.min[axis] = std::min(box.min[axis], coords[j]);
+					box.max[axis] = std::max(box.max[axis], coords[j]);
+				}
+			}
+		}
+		else
+		{
+			const NodeBox& left = m_Boxes[i + 1];
+			const NodeBox& right = m_Boxes[i + node.rightOffset()];
+			for (uint32_t axis = 0; axis < Dim; axis++)
+			{
+				box.min[axis] = std::min(left.min[axis], right.min[axis]);
+				box.max[axis] = std::max(left.max[axis], right.max[axis]);
+			}
+		}
+	}
+}
+
+template <uint32_t Dim, typename Coord>
+void DualTreeSearch<Dim, Coord>::allNearestNeighbors(uint32_t* indices, double* distances)
+{
+	if (m_Tree.m_Nodes.empty())
+		return;
+
+	const uint32_t count = m_Tree.size();
+	m_Indices = indices;
+	std::fill(indices, indices + count, Tree::InvalidIndex);
+	m_DistSq.assign(count, CoordTraits<Coord>::maxDistance());
+	m_Bounds.assign(m_Tree.m_Nodes.size(), CoordTraits<Coord>::maxDistance());
+	// Leaves emptied by erases have no point to improve.
+	for (size_t i = 0; i < m_Bounds.size(); i++)
+	{
+		if (m_Tree.m_Nodes[i].isLeaf() && m_Tree.m_Nodes[i].count() == 0)
+			m_Bounds[i] = 0;
+	}
+
+	// Each task owns a query subtree, so the points and bounds it updates are its own.
+	TaskPool& pool = TaskPool::global();
+	TaskPool::Group group;
+	spawnSearches(pool, group, m_Tree.m_Nodes.data(), 0);
+	pool.wait(group);
+
+	for (uint32_t i = 0; i < count; i++)
+		distances[i] = indices[i] == Tree::InvalidIndex ? std::numeric_limits<double>::max() : std::sqrt((double)m_DistSq[i]);
+	m_Indices = nullptr;
+}
+
+template <uint32_t Dim, typename Coord>
+void DualTreeSearch<Dim, Coord>::spawnSearches(TaskPool& pool, TaskPool::Group& group, const Node* query, uint32_t depth)
+{
+	// A few tasks per thread, so that threads which finish early can pick up more work.
+	const uint32_t taskCount = pool.threadCount() * 8;
+
+	if (!query->isLeaf() && (1u << depth) < taskCount)
+	{
+		spawnSearches(pool, group, query->left(), depth + 1);
+		spawnSearches(pool, group, query->right(), depth + 1);
+		return;
+	}
+
+	const Node* root = m_Tree.m_Nodes.data();
+	pool.run(group, [this, query, root]() { search(query, root); });
+}
+
+template <uint32_t Dim, typename Coord>
+void DualTreeSearch<Dim, Coord>::search(const Node* query, const Node* reference)
+{
+	// Reference nodes just as far as the bound are still searched, as they may hold a point at the same distance with a
+	// lower position, which KdTree::nearestNeighborOf would pick. Empty leaves have nothing to search for.
+	uint32_t q = nodeIndex(query);
+	if (boxDistanceSq(m_Boxes[q], m_Boxes[nodeIndex(reference)]) > m_Bounds[q] || (query->isLeaf() && query->count() == 0))
+		return;
+
+	if (query->isLeaf())
+	{
+		if (reference->isLeaf())
+			searchLeaves(query, reference);
+		else
+			searchReferenceChildren(query, reference);
+		return;
+	}
+
+	const Node* children[2] = { query->left(), query->right() };
+	for (const Node* child : children)
+	{
+		if (reference->isLeaf())
+			search(child, reference);
+		else
+			searchReferenceChildren(child, reference);
+	}
+
+	// The children's bounds only ever shrink, and so does their maximum.
+	m_Bounds[q] = std::max(m_Bounds[nodeIndex(query->left())], m_Bounds[nodeIndex(query->right())]);
+}
+
+template <uint32_t Dim, typename Coord>
+void DualTreeSearch<Dim, Coord>::searchReferenceChildren(const Node* query, const Node* reference)
+{
+	const NodeBox& box = m_Boxes[nodeIndex(query)];
+	const Node* nearChild = reference->left();
+	const Node* farChild = reference->right();
+	if (boxDistanceSq(box, m_Boxes[nodeIndex(farChild)]) < boxDistanceSq(box, m_Boxes[nodeIndex(nearChild)]))
+		std::swap(nearChild, farChild);
+
+	search(query, nearChild);
+	search(query, farChild);
+}
+
+template <uint32_t Dim, typename Coord>
+void DualTreeSearch<Dim, Coord>::searchLeaves(const Node* query, const Node* reference)
+{
+	const NodeBox& referenceBox = m_Boxes[nodeIndex(reference)];
+	uint32_t begin = reference->begin;
+	uint32_t end = begin + reference->count();
+
+	Distance bound = 0;
+	for (uint32_t i = query->begin; i < query->begin + query->count(); i++)
+	{
+		Distance& distSq = m_DistSq[i];
+		uint32_t& nearest = m_Indices[i];
+
+		// The query leaf as a whole may be in reach while this point is not.
+		NodeBox point;
+		for (uint32_t axis = 0; axis < Dim; axis++)
+			point.min[axis] = point.max[axis] = m_Tree.coords(axis)[i];
+		if (boxDistanceSq(point, referenceBox) <= distSq)
+		{
+			// As in KdTree::nearestNeighborOf, points at the query's coordinates other than the query itself are at
+			// distance zero and beat everything, but one at a lower position.
+			if (m_Tree.scanPoints(begin, end, point.min, distSq, nearest) && (distSq > 0 || begin < nearest))
+			{
+				for (uint32_t j = begin; j < end && (distSq > 0 || j < nearest); j++)
+				{
+					if (m_Tree.isAt(j, point.min) && j != i)
+					{
+						distSq = 0;
+						nearest = j;
+						break;
+					}
+				}
+			}
+		}
+		bound = std::max(bound, distSq);
+	}
+	m_Bounds[nodeIndex(query)] = bound;
+}
+
+template <uint32_t Dim, typename Coord>
+typename DualTreeSearch<Dim, Coord>::Distance DualTreeSearch<Dim, Coord>::boxDistanceSq(const NodeBox& a, const NodeBox& b)
+{
+	typedef CoordTraits<Coord> Traits;
+	Distance distSq = 0;
+	for (uint32_t axis = 0; axis < Dim; axis++)
+	{
+		Distance gap = 0;
+		if (a.max[axis] < b.min[axis])
+			gap = Traits::squaredDifference(b.min[axis], a.max[axis]);
+		else if (b.max[axis] < a.min[axis])
+			gap = Traits::squaredDifference(a.min[axis], b.max[axis]);
+
+		distSq = Traits::add(distSq, gap);
+	}
+	return distSq;
+}
+
+template class DualTreeSearch<2, int32_t>;
+template class DualTreeSearch<2, float>;
+template class DualTreeSearch<3, float>;
\ No newline at end of file
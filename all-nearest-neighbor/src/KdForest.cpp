@@ -0,0 +1,270 @@
+#include "../include/KdForest.h"
+
+#include <cmath>
+#include <limits>
+#include <stdexcept>
+
+
+template <uint32_t Dim, typename Coord>
+const uint32_t KdForest<Dim, Coord>::InvalidIndex;
+
+template <uint32_t Dim, typename Coord>
+KdForest<Dim, Coord>::KdForest(uint32_t leafCapacity, uint32_t bufferCapacity)
+	: m_LeafCapacity(leafCapacity), m_BufferCapacity(bufferCapacity)
+{
+	// Tuning the leaf capacity on every merge would cost more than the merges themselves.
+	if (leafCapacity == Tree::AutoLeafCapacity)
+		throw std::logic_error("KdForest needs an explicit leaf capacity.");
+	if (bufferCapacity == 0)
+		throw std::logic_error("KdForest needs a buffer.");
+
+	m_Buffer.reserve(bufferCapacity);
+}
+
+template <uint32_t Dim, typename Coord>
+KdForest<Dim, Coord>::~KdForest()
+{
+	// The task refers to this forest.
+	if (m_Merging)
+		TaskPool::global().wait(m_MergeTasks);
+}
+
+template <uint32_t Dim, typename Coord>
+uint32_t KdForest<Dim, Coord>::append(const Point& p)
+{
+	if (m_Size == MaxSize)
+		throw std::logic_error("Too many points for a KdForest.");
+
+	// Put a finished merge in place right away, so that queries search fewer components.
+	if (m_Merging && m_MergeTasks.pending == 0)
+		finishMerge();
+
+	m_Buffer.push_back(p);
+	uint32_t id = m_Size++;
+	if (m_Buffer.size() == m_BufferCapacity)
+		startMerge();
+
+	return id;
+}
+
+template <uint32_t Dim, typename Coord>
+void KdForest<Dim, Coord>::flush()
+{
+	finishMerge();
+}
+
+template <uint32_t Dim, typename Coord>
+uint32_t KdForest<Dim, Coord>::levelCount() const
+{
+	uint32_t count = 0;
+	for (const std::unique_ptr<Component>& level : m_Levels)
+		count += level ? 1 : 0;
+	return count;
+}
+
+template <uint32_t Dim, typename Coord>
+void KdForest<Dim, Coord>::startMerge()
+{
+	finishMerge();
+
+	uint32_t level = 0;
+	while (level < m_Levels.size() && m_Levels[level])
+		level++;
+
+	// The task gets the levels themselves, as m_Levels may grow before it is done.
+	std::vector<const Component*> sources;
+	for (uint32_t i = 0; i < level; i++)
+		sources.push_back(m_Levels[i].get());
+
+	// The old merge buffer is empty, and keeps its capacity for the next appends.
+	m_MergeBuffer.swap(m_Buffer);
+	m_MergeBufferBegin = m_Size - (uint32_t)m_MergeBuffer.size();
+	m_MergeLevel = level;
+	m_Merging = true;
+
+	TaskPool::global().run(m_MergeTasks, [this, sources]() { merge(sources); });
+}
+
+template <uint32_t Dim, typename Coord>
+void KdForest<Dim, Coord>::merge(const std::vector<const Component*>& sources)
+{
+	std::vector<Point> points(m_MergeBuffer);
+	std::vector<uint32_t> ids;
+	ids.reserve(points.size());
+	for (uint32_t i = 0; i < (uint32_t)m_MergeBuffer.size(); i++)
+		ids.push_back(m_MergeBufferBegin + i);
+
+	for (const Component* source : sources)
+	{
+		for (uint32_t i = 0; i < source->tree.size(); i++)
+		{
+			points.push_back(source->tree.point(i));
+			ids.push_back(source->ids[i]);
+		}
+	}
+
+	std::unique_ptr<Component> merged(new Component);
+	merged->tree.build(m_LeafCapacity, std::move(points));
+	merged->ids.resize(ids.size());
+	for (uint32_t i = 0; i < merged->tree.size(); i++)
+		merged->ids[i] = ids[merged->tree.id(i)];
+
+	m_Merged = std::move(merged);
+}
+
+template <uint32_t Dim, typename Coord>
+void KdForest<Dim, Coord>::finishMerge()
+{
+	if (!m_Merging)
+		return;
+
+	TaskPool::global().wait(m_MergeTasks);
+	m_Merging = false;
+
+	for (uint32_t i = 0; i < m_MergeLevel; i++)
+		m_Levels[i].reset();
+	if (m_Levels.size() <= m_MergeLevel)
+		m_Levels.resize(m_MergeLevel + 1);
+	m_Levels[m_MergeLevel] = std::move(m_Merged);
+	m_MergeBuffer.clear();
+}
+
+template <uint32_t Dim, typename Coord>
+template <typename Scan>
+void KdForest<Dim, Coord>::scanBuffers(Scan scan) const
+{
+	scan(m_Buffer, m_Size - (uint32_t)m_Buffer.size());
+	if (m_Merging)
+		scan(m_MergeBuffer, m_MergeBufferBegin);
+}
+
+template <uint32_t Dim, typename Coord>
+typename KdForest<Dim, Coord>::Distance KdForest<Dim, Coord>::squaredDistance(const Point& a, const Point& b)
+{
+	// Sums the axes in order, as the trees do.
+	typedef CoordTraits<Coord> Traits;
+	Distance distSq = Traits::squaredDifference(a[0], b[0]);
+	for (uint32_t axis = 1; axis < Dim; axis++)
+		distSq = Traits::add(distSq, Traits::squaredDifference(a[axis], b[axis]));
+	return distSq;
+}
+
+template <uint32_t Dim, typename Coord>
+uint32_t KdForest<Dim, Coord>::nearestNeighbor(const Point& p, double& distance, double epsilon) const
+{
+	const double pruneScale = Tree::pruneScaleFor(epsilon);
+	Distance distSq = CoordTraits<Coord>::maxDistance();
+	uint32_t nearest = InvalidIndex;
+
+	scanBuffers([&](const std::vector<Point>& points, uint32_t firstId)
+	{
+		for (uint32_t i = 0; i < (uint32_t)points.size(); i++)
+		{
+			Distance d = squaredDistance(points[i], p);
+			if (d < distSq && !(d == 0 && points[i] == p))
+			{
+				distSq = d;
+				nearest = firstId + i;
+			}
+		}
+	});
+
+	// The largest levels first, as they are the most likely to hold a close point.
+	for (size_t level = m_Levels.size(); level-- > 0;)
+	{
+		const Component* component = m_Levels[level].get();
+		if (!component)
+			continue;
+
+		uint32_t position = InvalidIndex;
+		component->tree.nearestNeighborSearch(p, Tree::InvalidIndex, position, distSq, pruneScale);
+		if (position != InvalidIndex)
+			nearest = component->ids[position];
+	}
+
+	distance = nearest == InvalidIndex ? std::numeric_limits<double>::max() : std::sqrt((double)distSq);
+	return nearest;
+}
+
+template <uint32_t Dim, typename Coord>
+uint32_t KdForest<Dim, Coord>::kNearestNeighbors(const Point& p, uint32_t k, uint32_t* ids, double* distances, double epsilon) const
+{
+	const double pruneScale = Tree::pruneScaleFor(epsilon);
+	if (k == 0)
+		return 0;
+
+	Distance stackDistSq[Tree::KnnStackCapacity];
+	std::vector<Distance> heapDistSq;
+	if (k > Tree::KnnStackCapacity)
+		heapDistSq.resize(k);
+
+	// The candidates are shared by all components. Each tree inserts its own positions, which are turned into ids
+	// right after it is searched. Entries holding ids are marked with the top bit, which no id uses.
+	const uint32_t IdFlag = ~MaxSize;
+	typename Tree::KnnCandidates candidates = { k > Tree::KnnStackCapacity ? heapDistSq.data() : stackDistSq, ids, k, 0 };
+
+	scanBuffers([&](const std::vector<Point>& points, uint32_t firstId)
+	{
+		for (uint32_t i = 0; i < (uint32_t)points.size(); i++)
+		{
+			Distance d = squaredDistance(points[i], p);
+			if (d < candidates.bound() && !(d == 0 && points[i] == p))
+				candidates.insert(d, (firstId + i) | IdFlag);
+		}
+	});
+
+	for (size_t level = m_Levels.size(); level-- > 0;)
+	{
+		const Component* component = m_Levels[level].get();
+		if (!component)
+			continue;
+
+		component->tree.kNearestNeighborsSearch(p, Tree::InvalidIndex, candidates, pruneScale);
+		for (uint32_t i = 0; i < candidates.count; i++)
+		{
+			if (!(ids[i] & IdFlag))
+				ids[i] = component->ids[ids[i]] | IdFlag;
+		}
+	}
+
+	for (uint32_t i = 0; i < candidates.count; i++)
+	{
+		ids[i] &= ~IdFlag;
+		distances[i] = std::sqrt((double)candidates.distSq[i]);
+	}
+
+	return candidates.count;
+}
+
+template <uint32_t Dim, typename Coord>
+void KdForest<Dim, Coord>::radiusSearch(const Point& p, double r, std::vector<uint32_t>& ids) const
+{
+	Distance radiusSq;
+	if (!CoordTraits<Coord>::radiusToSquared(r, radiusSq))
+		return;
+
+	scanBuffers([&](const std::vector<Point>& points, uint32_t firstId)
+	{
+		for (uint32_t i = 0; i < (uint32_t)points.size(); i++)
+		{
+			if (squaredDistance(points[i], p) <= radiusSq)
+				ids.push_back(firstId + i);
+		}
+	});
+
+	std::vector<uint32_t> positions;
+	for (const std::unique_ptr<Component>& component : m_Levels)
+	{
+		if (!component)
+			continue;
+
+		positions.clear();
+		component->tree.radiusSearch(p, r, positions);
+		for (uint32_t position : positions)
+			ids.push_back(component->ids[position]);
+	}
+}
+
+template class KdForest<2, int32_t>;
+template class KdForest<2, float>;
+template class KdForest<3, float>;
\ No newline at end of file
@@ -1,192 +1,2083 @@
 #include "../include/KdTree.h"
+#include "../include/TaskPool.h"
 
 #include <stdexcept>
 #include <iostream>
 #include <numeric>
 #include <algorithm>
 #include <cmath>
+#include <chrono>
+#include <limits>
+#include <fstream>
+#include <cstring>
 
 
-KdTree::~KdTree()
+#ifdef KDTREE_PARALLEL_BUILD
+// Stable partition of data[begin, end), split in chunks handled by separate tasks. Returns the end of the elements
+// for which pred holds. scratch must be valid over the same range. The result does not depend on the thread count.
+template <typename T, typename Predicate>
+static uint32_t parallelStablePartition(TaskPool& pool, T* data, T* scratch, uint32_t begin, uint32_t end, Predicate pred)
+{
+	const uint32_t chunkSize = 1 << 16;
+	const uint32_t chunkCount = (end - begin + chunkSize - 1) / chunkSize;
+	auto chunkBegin = [&](uint32_t chunk) { return begin + chunk * chunkSize; };
+	auto chunkEnd = [&](uint32_t chunk) { return std::min(end, begin + (chunk + 1) * chunkSize); };
+
+	// Count the elements going to the front in each chunk.
+	std::vector<uint32_t> frontCounts(chunkCount);
+	pool.parallelFor(chunkCount, [&](uint32_t chunk)
+	{
+		uint32_t n = 0;
+		for (uint32_t i = chunkBegin(chunk); i < chunkEnd(chunk); i++)
+			n += pred(data[i]) ? 1 : 0;
+		frontCounts[chunk] = n;
+	});
+
+	// Where each chunk writes its elements.
+	std::vector<uint32_t> frontOffsets(chunkCount);
+	std::vector<uint32_t> backOffsets(chunkCount);
+	uint32_t mid = begin;
+	for (uint32_t chunk = 0; chunk < chunkCount; chunk++)
+	{
+		frontOffsets[chunk] = mid;
+		mid += frontCounts[chunk];
+	}
+	uint32_t back = mid;
+	for (uint32_t chunk = 0; chunk < chunkCount; chunk++)
+	{
+		backOffsets[chunk] = back;
+		back += chunkEnd(chunk) - chunkBegin(chunk) - frontCounts[chunk];
+	}
+
+	pool.parallelFor(chunkCount, [&](uint32_t chunk)
+	{
+		uint32_t front = frontOffsets[chunk];
+		uint32_t back = backOffsets[chunk];
+		for (uint32_t i = chunkBegin(chunk); i < chunkEnd(chunk); i++)
+		{
+			if (pred(data[i]))
+				scratch[front++] = data[i];
+			else
+				scratch[back++] = data[i];
+		}
+	});
+
+	pool.parallelFor(chunkCount, [&](uint32_t chunk)
+	{
+		std::copy(scratch + chunkBegin(chunk), scratch + chunkEnd(chunk), data + chunkBegin(chunk));
+	});
+
+	return mid;
+}
+#endif
+
+
+// Passed by reference to standard algorithms, so it needs a definition.
+template <uint32_t Dim, typename Coord>
+const uint32_t KdTree<Dim, Coord>::InvalidIndex;
+
+template <uint32_t Dim, typename Coord>
+void KdTree<Dim, Coord>::build(uint32_t leafCapacity, const std::vector<Point>& points, BuildMode mode)
+{
+	auto coordAt = [&points](uint32_t i, uint32_t axis) { return points[i][axis]; };
+	if (!loadBuildPoints(leafCapacity, points.size(), coordAt, mode))
+		return;
+
+	loadNames((uint32_t)points.size(), [&points](uint32_t i, size_t& length)
+	{
+		length = points[i].m_name.size();
+		return points[i].m_name.data();
+	});
+	buildLoadedPoints();
+}
+
+template <uint32_t Dim, typename Coord>
+void KdTree<Dim, Coord>::build(uint32_t leafCapacity, std::vector<Point>&& points, BuildMode mode)
+{
+	auto coordAt = [&points](uint32_t i, uint32_t axis) { return points[i][axis]; };
+	if (!loadBuildPoints(leafCapacity, points.size(), coordAt, mode))
+		return;
+
+	loadNames((uint32_t)points.size(), [&points](uint32_t i, size_t& length)
+	{
+		length = points[i].m_name.size();
+		return points[i].m_name.data();
+	});
+
+	// Everything needed has been taken, so the points are freed before the tree is built.
+	std::vector<Point>().swap(points);
+	buildLoadedPoints();
+}
+
+template <uint32_t Dim, typename Coord>
+void KdTree<Dim, Coord>::build(uint32_t leafCapacity, Coord* coords, uint32_t count)
+{
+	auto coordAt = [coords](uint32_t i, uint32_t axis) { return coords[(size_t)i * Dim + axis]; };
+	if (!loadBuildPoints(leafCapacity, count, coordAt, BuildMode::Presort, false))
+		return;
+
+	m_BuildSource = coords;
+	m_BuildSourceCount = count;
+	buildLoadedPoints();
+}
+
+template <uint32_t Dim, typename Coord>
+void KdTree<Dim, Coord>::build(uint32_t leafCapacity, const BasicPointArrays<Dim, Coord>& points, BuildMode mode)
+{
+	auto coordAt = [&points](uint32_t i, uint32_t axis) { return points.coords[axis][i]; };
+	if (!loadBuildPoints(leafCapacity, points.size(), coordAt, mode))
+		return;
+
+	// The names are packed already, with offsets of the same type: both are copied in one go.
+	const uint32_t count = points.size();
+	const uint64_t charsBegin = points.nameOffsets[0];
+	const uint64_t charsEnd = points.nameOffsets[count];
+	if (charsEnd > charsBegin)
+	{
+		std::vector<uint64_t> offsets(points.nameOffsets.begin(), points.nameOffsets.begin() + (size_t)count + 1);
+		if (charsBegin != 0)
+		{
+			for (uint64_t& offset : offsets)
+				offset -= charsBegin;
+		}
+		m_NameChars.assign(std::vector<char>(points.names.begin() + (size_t)charsBegin, points.names.begin() + (size_t)charsEnd));
+		m_NameOffsets.assign(std::move(offsets));
+	}
+	buildLoadedPoints();
+}
+
+template <uint32_t Dim, typename Coord>
+void KdTree<Dim, Coord>::build(uint32_t leafCapacity, BasicPointArrays<Dim, Coord>&& points, BuildMode mode)
+{
+	auto coordAt = [&points](uint32_t i, uint32_t axis) { return points.coords[axis][i]; };
+	if (!loadBuildPoints(leafCapacity, points.size(), coordAt, mode, false))
+		return;
+
+	// The names are taken over, after dropping any characters before the first one.
+	const uint32_t count = points.size();
+	const uint64_t charsBegin = points.nameOffsets[0];
+	const uint64_t charsEnd = points.nameOffsets[count];
+	if (charsEnd > charsBegin)
+	{
+		points.names.resize((size_t)charsEnd);
+		points.names.erase(points.names.begin(), points.names.begin() + (size_t)charsBegin);
+		points.nameOffsets.resize((size_t)count + 1);
+		if (charsBegin != 0)
+		{
+			for (uint64_t& offset : points.nameOffsets)
+				offset -= charsBegin;
+		}
+		m_NameChars.assign(std::move(points.names));
+		m_NameOffsets.assign(std::move(points.nameOffsets));
+	}
+	std::vector<char>().swap(points.names);
+	std::vector<uint64_t>().swap(points.nameOffsets);
+
+	// The coordinates are packed one axis at a time, each freed once packed.
+	m_BuildPoints.resize(count);
+	BuildPoint* built = m_BuildPoints.data();
+	for (uint32_t i = 0; i < count; i++)
+		built[i].id = i;
+	for (uint32_t j = 0; j < Dim; j++)
+	{
+		const Coord* column = points.coords[j].data();
+		for (uint32_t i = 0; i < count; i++)
+			built[i].coords[j] = column[i];
+		std::vector<Coord>().swap(points.coords[j]);
+	}
+	buildLoadedPoints();
+}
+
+template <uint32_t Dim, typename Coord>
+template <typename CoordAt>
+bool KdTree<Dim, Coord>::loadBuildPoints(uint32_t leafCapacity, size_t pointCount, CoordAt coordAt, BuildMode mode, bool copy)
+{
+	if (pointCount == 0)
+	{
+		std::cout << "Empty point set. Will not build." << std::endl;
+		return false;
+	}
+	// Leaf counts must fit in a node, even when all points coincide.
+	if (pointCount > Node::MaxPayload)
+		throw std::logic_error("Too many points for a KdTree.");
+
+	const uint32_t count = (uint32_t)pointCount;
+	m_LeafCapacity = leafCapacity == AutoLeafCapacity ? tuneLeafCapacity(count, coordAt, mode) : leafCapacity > Node::MaxPayload ? (uint32_t)Node::MaxPayload : leafCapacity;
+	m_BuildMode = mode;
+	m_NameChars.clear();
+	m_NameOffsets.clear();
+
+	// Find bounding box containing all points.
+	m_AABB = AABB();
+	for (uint32_t j = 0; j < Dim; j++)
+	{
+		m_AABB.min[j] = std::numeric_limits<Coord>::max();
+		m_AABB.max[j] = std::numeric_limits<Coord>::lowest();
+	}
+	m_BuildPoints.resize(copy ? count : 0);
+	BuildPoint* points = m_BuildPoints.data();
+	for (uint32_t i = 0; i < count; i++)
+	{
+		for (uint32_t j = 0; j < Dim; j++)
+		{
+			Coord value = coordAt(i, j);
+			if (value < m_AABB.min[j])
+				m_AABB.min[j] = value;
+			if (value > m_AABB.max[j])
+				m_AABB.max[j] = value;
+			if (copy)
+				points[i].coords[j] = value;
+		}
+		if (copy)
+			points[i].id = i;
+	}
+	return true;
+}
+
+template <uint32_t Dim, typename Coord>
+template <typename NameAt>
+void KdTree<Dim, Coord>::loadNames(uint32_t count, NameAt nameAt)
+{
+	uint64_t charCount = 0;
+	for (uint32_t i = 0; i < count; i++)
+	{
+		size_t length;
+		nameAt(i, length);
+		charCount += length;
+	}
+	if (charCount == 0)
+		return;
+
+	std::vector<char> chars((size_t)charCount);
+	std::vector<uint64_t> offsets((size_t)count + 1);
+	uint64_t offset = 0;
+	for (uint32_t i = 0; i < count; i++)
+	{
+		size_t length;
+		const char* name = nameAt(i, length);
+		offsets[i] = offset;
+		std::memcpy(chars.data() + (size_t)offset, name, length);
+		offset += length;
+	}
+	offsets[count] = offset;
+	m_NameChars.assign(std::move(chars));
+	m_NameOffsets.assign(std::move(offsets));
+}
+
+template <uint32_t Dim, typename Coord>
+void KdTree<Dim, Coord>::appendName(const std::string& name)
+{
+	m_NameChars.append(name.data(), name.size());
+	const uint64_t offset = m_NameChars.size();
+	m_NameOffsets.append(&offset, 1);
+}
+
+template <uint32_t Dim, typename Coord>
+void KdTree<Dim, Coord>::buildLoadedPoints()
+{
+	const uint32_t count = m_BuildSource ? m_BuildSourceCount : (uint32_t)m_BuildPoints.size();
+	std::vector<Node> nodes;
+	buildNodes(m_AABB, m_LeafCapacity, nodes);
+	m_Depth = treeDepth(nodes.data(), nodes.size());
+	m_Nodes.assign(std::move(nodes));
+	m_PointCount = count;
+	std::vector<uint32_t>().swap(m_Positions);
+
+	// The caller's coordinates are put in tree order in place, following the cycles of the permutation, then
+	// transposed in place into one array per axis. The tree order itself gives the ids.
+	if (m_BuildSource)
+	{
+		Coord* coords = m_BuildSource;
+		std::vector<uint32_t> ids;
+		ids.swap(m_Sorted[0]);
+		releaseBuildState();
+
+		std::vector<bool> placed(count);
+		for (uint32_t i = 0; i < count; i++)
+		{
+			if (placed[i])
+				continue;
+
+			Coord first[Dim];
+			std::copy(coords + (size_t)i * Dim, coords + (size_t)i * Dim + Dim, first);
+			uint32_t j = i;
+			while (ids[j] != i)
+			{
+				std::copy(coords + (size_t)ids[j] * Dim, coords + (size_t)ids[j] * Dim + Dim, coords + (size_t)j * Dim);
+				placed[j] = true;
+				j = ids[j];
+			}
+			std::copy(first, first + Dim, coords + (size_t)j * Dim);
+			placed[j] = true;
+		}
+		transposeWords((char*)coords, count, Dim);
+
+		// The buffer belongs to the caller, so the tree only keeps a reference that frees nothing.
+		std::shared_ptr<const void> owner(coords, [](const void*) {});
+		for (uint32_t j = 0; j < Dim; j++)
+			m_Coords[j].map(owner, coords + (size_t)j * count, count);
+		m_Ids.assign(std::move(ids));
+		return;
+	}
+
+	// Presorted points are put in tree order in place, following the cycles of the permutation, which is used up.
+	if (m_BuildMode == BuildMode::Presort)
+	{
+		std::vector<uint32_t>& order = m_Sorted[0];
+		for (uint32_t i = 0; i < count; i++)
+		{
+			if (order[i] == i)
+				continue;
+
+			BuildPoint first = m_BuildPoints[i];
+			uint32_t j = i;
+			while (order[j] != i)
+			{
+				uint32_t next = order[j];
+				m_BuildPoints[j] = m_BuildPoints[next];
+				order[j] = j;
+				j = next;
+			}
+			m_BuildPoints[j] = first;
+			order[j] = j;
+		}
+	}
+
+	// The packed arrays are not allocated next to the points: the points are transposed in place into one array per
+	// axis followed by the ids, which the packed arrays then refer to. The point data is never held twice.
+	std::shared_ptr<std::vector<BuildPoint>> points = std::make_shared<std::vector<BuildPoint>>();
+	points->swap(m_BuildPoints);
+	releaseBuildState();
+	static_assert(sizeof(BuildPoint) == (Dim + 1) * sizeof(uint32_t), "Build points are made of 32-bit words.");
+	transposeWords((char*)points->data(), count, Dim + 1);
+
+	const char* words = (const char*)points->data();
+	for (uint32_t j = 0; j < Dim; j++)
+		m_Coords[j].map(points, (const Coord*)(words + (size_t)j * count * sizeof(Coord)), count);
+	m_Ids.map(points, (const uint32_t*)(words + (size_t)Dim * count * sizeof(Coord)), count);
+}
+
+template <uint32_t Dim, typename Coord>
+void KdTree<Dim, Coord>::transposeWords(char* words, size_t count, size_t fieldCount)
+{
+	static_assert(sizeof(Coord) == sizeof(uint32_t), "Coordinates are 32-bit words.");
+
+	// Word f of record i moves to f * count + i. Each cycle of that permutation is followed once, carrying one word.
+	const size_t wordCount = count * fieldCount;
+	std::vector<bool> moved(wordCount);
+	for (size_t start = 0; start < wordCount; start++)
+	{
+		if (moved[start])
+			continue;
+
+		uint32_t carried;
+		std::memcpy(&carried, words + start * sizeof(uint32_t), sizeof(uint32_t));
+		size_t position = start;
+		do
+		{
+			position = position % fieldCount * count + position / fieldCount;
+			uint32_t word;
+			std::memcpy(&word, words + position * sizeof(uint32_t), sizeof(uint32_t));
+			std::memcpy(words + position * sizeof(uint32_t), &carried, sizeof(uint32_t));
+			carried = word;
+			moved[position] = true;
+		} while (position != start);
+	}
+}
+
+template <uint32_t Dim, typename Coord>
+void KdTree<Dim, Coord>::buildNodes(const AABB& aabb, uint32_t leafCapacity, std::vector<Node>& nodes)
+{
+	const uint32_t count = m_BuildSource ? m_BuildSourceCount : (uint32_t)m_BuildPoints.size();
+	m_BuildLeafCapacity = leafCapacity;
+
+	if (m_BuildMode == BuildMode::Presort)
+	{
+		// Sort (coordinate, index) keys, which keeps the sort cache friendly and breaks ties by index.
+		std::vector<uint64_t> keys(count);
+		for (uint32_t j = 0; j < Dim; j++)
+		{
+			for (uint32_t i = 0; i < count; i++)
+				keys[i] = ((uint64_t)CoordTraits<Coord>::sortKey(presortedCoord(i, j)) << 32) | i;
+			std::sort(keys.begin(), keys.end());
+
+			m_Sorted[j].resize(count);
+			for (uint32_t i = 0; i < count; i++)
+				m_Sorted[j][i] = (uint32_t)keys[i];
+		}
+		m_PartitionScratch.resize(count);
+	}
+
+	nodes.clear();
+	NodeBuffer root;
+
+#ifdef KDTREE_PARALLEL_BUILD
+	// Large subtrees are split off into tasks building into their own buffers, with placeholders standing in for them.
+	// Once all tasks are done the final tree is assembled in nodes, in a single allocation.
+	ParallelBuild parallelBuild(TaskPool::global());
+	m_ParallelBuild = &parallelBuild;
+	if (m_BuildMode == BuildMode::Select && count > ParallelPartitionCutoff)
+		parallelBuild.partitionScratch.resize(count);
+
+	buildRecursive(0, count, aabb, root);
+	parallelBuild.pool.wait(parallelBuild.tasks);
+
+	if (root.hasPlaceholders)
+	{
+		size_t nodeCount = root.nodes.size() - parallelBuild.buffers.size();
+		for (size_t i = 0; i < parallelBuild.buffers.size(); i++)
+			nodeCount += parallelBuild.buffers[i].nodes.size();
+
+		nodes.reserve(nodeCount);
+		spliceNodeBuffer(root, nodes);
+	}
+	else
+		nodes.swap(root.nodes);
+	m_ParallelBuild = nullptr;
+#else
+	// A single allocation, unless coincident coordinates unbalance some splits.
+	root.nodes.reserve(balancedNodeCount(count, m_BuildLeafCapacity));
+
+	// Build tree recursevily.
+	buildRecursive(0, count, aabb, root);
+	nodes.swap(root.nodes);
+#endif
+}
+
+template <uint32_t Dim, typename Coord>
+const typename KdTree<Dim, Coord>::BuildPoint& KdTree<Dim, Coord>::builtPoint(uint32_t index) const
+{
+	// When presorted, m_BuildPoints was never moved and any of the sorted arrays gives the tree order.
+	return m_BuildPoints[m_BuildMode == BuildMode::Presort ? m_Sorted[0][index] : index];
+}
+
+template <uint32_t Dim, typename Coord>
+void KdTree<Dim, Coord>::releaseBuildState()
+{
+	std::vector<BuildPoint>().swap(m_BuildPoints);
+	m_BuildSource = nullptr;
+	m_BuildSourceCount = 0;
+	for (uint32_t j = 0; j < Dim; j++)
+		std::vector<uint32_t>().swap(m_Sorted[j]);
+	std::vector<uint32_t>().swap(m_PartitionScratch);
+}
+
+template <uint32_t Dim, typename Coord>
+std::string KdTree<Dim, Coord>::name(uint32_t id) const
+{
+	size_t length;
+	const char* chars = name(id, length);
+	return std::string(chars, length);
+}
+
+template <uint32_t Dim, typename Coord>
+const char* KdTree<Dim, Coord>::name(uint32_t id, size_t& length) const
+{
+	if (m_NameOffsets.empty())
+	{
+		length = 0;
+		return "";
+	}
+
+	length = (size_t)(m_NameOffsets[id + 1] - m_NameOffsets[id]);
+	return m_NameChars.data() + m_NameOffsets[id];
+}
+
+template <uint32_t Dim, typename Coord>
+typename KdTree<Dim, Coord>::Point KdTree<Dim, Coord>::point(uint32_t index) const
+{
+	Point p;
+	ForEachAxis<Dim>::run([&](uint32_t j) { p[j] = m_Coords[j][index]; });
+	p.m_name = name(m_Ids[index]);
+	return p;
+}
+
+namespace
+{
+	// A snapshot file starts with this header, followed by each array at the offset it gives, as laid out in memory on
+	// the machine that wrote it. Offsets count from the start of the file, so that it can be mapped anywhere.
+	struct SnapshotHeader
+	{
+		char magic[8];
+		uint32_t version;
+		// SnapshotByteOrder as written, which reads differently on machines of the other byte order.
+		uint32_t byteOrder;
+		uint32_t dimensions;
+		uint32_t coordSize;
+		uint32_t integralCoords;
+		uint32_t buildMode;
+		uint32_t leafCapacity;
+		// For information only: loadSnapshot() recomputes it from the nodes.
+		uint32_t depth;
+		uint32_t pointCount;
+		uint32_t positionCount;
+		uint32_t nodeCount;
+		// One past the largest id given out. Above positionCount once points have been erased.
+		uint32_t idCount;
+		// Doubles hold any coordinate exactly.
+		double aabbMin[3];
+		double aabbMax[3];
+		uint64_t nodesOffset;
+		uint64_t coordsOffset[3];
+		uint64_t idsOffset;
+		// The names: idCount + 1 offsets into the characters, as in memory. Both 0 if no point has a name.
+		uint64_t nameOffsetsOffset;
+		uint64_t nameCharsOffset;
+		uint64_t fileSize;
+	};
+
+	const char SnapshotMagic[8] = { 'K', 'D', 'T', 'R', 'E', 'E', 'S', 'N' };
+	const uint32_t SnapshotVersion = 3;
+	const uint32_t SnapshotByteOrder = 0x01020304;
+	// Sections start on cache line boundaries.
+	const uint64_t SnapshotAlignment = 64;
+
+	inline uint64_t alignSnapshotOffset(uint64_t offset)
+	{
+		return (offset + SnapshotAlignment - 1) & ~(SnapshotAlignment - 1);
+	}
+}
+
+template <uint32_t Dim, typename Coord>
+void KdTree<Dim, Coord>::saveSnapshot(const std::string& path) const
+{
+	if (m_Nodes.empty())
+		throw std::logic_error("KdTree has not been built or is empty.");
+
+	SnapshotHeader header = {};
+	std::memcpy(header.magic, SnapshotMagic, sizeof(header.magic));
+	header.version = SnapshotVersion;
+	header.byteOrder = SnapshotByteOrder;
+	header.dimensions = Dim;
+	header.coordSize = sizeof(Coord);
+	header.integralCoords = std::is_integral<Coord>::value ? 1 : 0;
+	header.buildMode = (uint32_t)m_BuildMode;
+	header.leafCapacity = m_LeafCapacity;
+	header.depth = m_Depth;
+	header.pointCount = m_PointCount;
+	header.positionCount = size();
+	header.nodeCount = (uint32_t)m_Nodes.size();
+	header.idCount = m_Positions.empty() ? size() : (uint32_t)m_Positions.size();
+	for (uint32_t j = 0; j < Dim; j++)
+	{
+		header.aabbMin[j] = (double)m_AABB.min[j];
+		header.aabbMax[j] = (double)m_AABB.max[j];
+	}
+
+	uint64_t offset = alignSnapshotOffset(sizeof(SnapshotHeader));
+	header.nodesOffset = offset;
+	offset = alignSnapshotOffset(offset + m_Nodes.size() * sizeof(Node));
+	for (uint32_t j = 0; j < Dim; j++)
+	{
+		header.coordsOffset[j] = offset;
+		offset = alignSnapshotOffset(offset + (uint64_t)size() * sizeof(Coord));
+	}
+	header.idsOffset = offset;
+	offset += (uint64_t)size() * sizeof(uint32_t);
+	if (!m_NameOffsets.empty())
+	{
+		header.nameOffsetsOffset = alignSnapshotOffset(offset);
+		header.nameCharsOffset = alignSnapshotOffset(header.nameOffsetsOffset + m_NameOffsets.size() * sizeof(uint64_t));
+		offset = header.nameCharsOffset + m_NameChars.size();
+	}
+	header.fileSize = offset;
+
+	std::ofstream file(path, std::ios::binary | std::ios::trunc);
+	if (!file)
+		throw std::logic_error("Cannot write " + path + ".");
+
+	uint64_t written = 0;
+	auto write = [&](uint64_t at, const void* data, size_t bytes)
+	{
+		static const char padding[SnapshotAlignment] = {};
+		file.write(padding, (std::streamsize)(at - written));
+		file.write((const char*)data, (std::streamsize)bytes);
+		written = at + bytes;
+	};
+	write(0, &header, sizeof(header));
+	write(header.nodesOffset, m_Nodes.data(), m_Nodes.size() * sizeof(Node));
+	for (uint32_t j = 0; j < Dim; j++)
+		write(header.coordsOffset[j], m_Coords[j].data(), (size_t)size() * sizeof(Coord));
+	write(header.idsOffset, m_Ids.data(), (size_t)size() * sizeof(uint32_t));
+	if (header.nameOffsetsOffset != 0)
+	{
+		write(header.nameOffsetsOffset, m_NameOffsets.data(), m_NameOffsets.size() * sizeof(uint64_t));
+		write(header.nameCharsOffset, m_NameChars.data(), m_NameChars.size());
+	}
+
+	if (!file.flush())
+		throw std::logic_error("Cannot write " + path + ".");
+}
+
+template <uint32_t Dim, typename Coord>
+void KdTree<Dim, Coord>::loadSnapshot(const std::string& path)
+{
+	std::shared_ptr<const MappedFile> file = std::make_shared<const MappedFile>(path);
+
+	SnapshotHeader header;
+	if (file->size() < sizeof(header))
+		throw std::logic_error(path + " is not a KdTree snapshot.");
+	std::memcpy(&header, file->data(), sizeof(header));
+
+	if (std::memcmp(header.magic, SnapshotMagic, sizeof(header.magic)) != 0 || header.byteOrder != SnapshotByteOrder)
+		throw std::logic_error(path + " is not a KdTree snapshot.");
+	if (header.version != SnapshotVersion)
+		throw std::logic_error(path + " is a snapshot of another version.");
+	if (header.dimensions != Dim || header.coordSize != sizeof(Coord) || header.integralCoords != (std::is_integral<Coord>::value ? 1u : 0u))
+		throw std::logic_error(path + " is a snapshot of another type of tree.");
+	if (header.fileSize != file->size() || header.nodeCount == 0 || header.positionCount > Node::MaxPayload ||
+		header.pointCount > header.positionCount || header.leafCapacity == 0 || header.leafCapacity > Node::MaxPayload)
+		throw std::logic_error(path + " is damaged.");
+
+	// The start of a section, after checking that it lies within the file.
+	auto section = [&](uint64_t offset, uint64_t bytes)
+	{
+		if (offset % SnapshotAlignment != 0 || offset > file->size() || bytes > file->size() - offset)
+			throw std::logic_error(path + " is damaged.");
+		return file->data() + offset;
+	};
+
+	// Nodes and ids are checked once up front, so that queries and updates can trust them: every node must lie within
+	// the file, ids must index m_Positions once updated, and leaves must only cover positions holding a point, each
+	// counted once. Checking the leaves' ranges against pointCount before reading them keeps this linear.
+	const uint32_t* ids = (const uint32_t*)section(header.idsOffset, (uint64_t)header.positionCount * sizeof(uint32_t));
+	uint32_t idsInUse = 0;
+	for (uint32_t i = 0; i < header.positionCount; i++)
+	{
+		if (ids[i] == InvalidIndex)
+			continue;
+		if (ids[i] >= header.idCount)
+			throw std::logic_error(path + " is damaged.");
+		idsInUse++;
+	}
+	if (idsInUse != header.pointCount)
+		throw std::logic_error(path + " is damaged.");
+
+	const Node* nodes = (const Node*)section(header.nodesOffset, (uint64_t)header.nodeCount * sizeof(Node));
+	uint64_t leafPoints = 0;
+	for (uint32_t i = 0; i < header.nodeCount; i++)
+	{
+		const Node& node = nodes[i];
+		if (!node.isLeaf())
+		{
+			if (node.axis() >= Dim || node.rightOffset() < 2 || node.rightOffset() >= header.nodeCount - i)
+				throw std::logic_error(path + " is damaged.");
+			continue;
+		}
+
+		leafPoints += node.count();
+		if ((uint64_t)node.begin + node.count() > header.positionCount || leafPoints > header.pointCount)
+			throw std::logic_error(path + " is damaged.");
+		for (uint32_t k = node.begin; k < node.begin + node.count(); k++)
+		{
+			if (ids[k] == InvalidIndex)
+				throw std::logic_error(path + " is damaged.");
+		}
+	}
+
+	// Updates rely on the leaves reached from the root holding increasing ranges of positions, in depth-first order.
+	// Nodes are reached in increasing order too, so none can be reached twice.
+	std::vector<uint32_t> stack(1, 0);
+	int64_t previousNode = -1;
+	uint64_t previousEnd = 0;
+	while (!stack.empty())
+	{
+		uint32_t i = stack.back();
+		stack.pop_back();
+		if ((int64_t)i <= previousNode)
+			throw std::logic_error(path + " is damaged.");
+		previousNode = i;
+
+		const Node& node = nodes[i];
+		if (node.isLeaf())
+		{
+			if (node.begin < previousEnd)
+				throw std::logic_error(path + " is damaged.");
+			previousEnd = (uint64_t)node.begin + node.count();
+			continue;
+		}
+		stack.push_back(i + node.rightOffset());
+		stack.push_back(i + 1);
+	}
+
+	const uint64_t* nameOffsets = nullptr;
+	const char* nameChars = nullptr;
+	if (header.nameOffsetsOffset != 0)
+	{
+		nameOffsets = (const uint64_t*)section(header.nameOffsetsOffset, ((uint64_t)header.idCount + 1) * sizeof(uint64_t));
+		for (uint32_t id = 0; id < header.idCount; id++)
+		{
+			if (nameOffsets[id] > nameOffsets[id + 1])
+				throw std::logic_error(path + " is damaged.");
+		}
+		if (nameOffsets[0] != 0)
+			throw std::logic_error(path + " is damaged.");
+		nameChars = section(header.nameCharsOffset, nameOffsets[header.idCount]);
+	}
+
+	m_Nodes.map(file, nodes, header.nodeCount);
+	for (uint32_t j = 0; j < Dim; j++)
+		m_Coords[j].map(file, (const Coord*)section(header.coordsOffset[j], (uint64_t)header.positionCount * sizeof(Coord)), header.positionCount);
+	m_Ids.map(file, ids, header.positionCount);
+	if (nameOffsets)
+	{
+		m_NameOffsets.map(file, nameOffsets, (size_t)header.idCount + 1);
+		m_NameChars.map(file, nameChars, (size_t)nameOffsets[header.idCount]);
+	}
+	else
+	{
+		m_NameOffsets.clear();
+		m_NameChars.clear();
+	}
+
+	for (uint32_t j = 0; j < Dim; j++)
+	{
+		m_AABB.min[j] = (Coord)header.aabbMin[j];
+		m_AABB.max[j] = (Coord)header.aabbMax[j];
+	}
+	m_BuildMode = header.buildMode == (uint32_t)BuildMode::Presort ? BuildMode::Presort : BuildMode::Select;
+	m_LeafCapacity = header.leafCapacity;
+	// Recomputed rather than read, as it sizes the traversal stacks.
+	m_Depth = treeDepth(nodes, header.nodeCount);
+	m_PointCount = header.pointCount;
+
+	// Updated trees may have given out more ids than they have positions, which insert() must carry on from.
+	std::vector<uint32_t>().swap(m_Positions);
+	if (header.idCount != header.positionCount)
+		trackPositions(header.idCount);
+}
+
+namespace
+{
+	// Bounds on the fraction of a subtree's positions holding a point. Rebuilds bring subtrees back within them.
+	// As in a packed memory array, they are loosest at the leaves and tighten linearly towards the root, so that
+	// a rebuilt subtree takes many updates to cross them again.
+	const double LeafMaxDensity = 1.0;
+	const double RootMaxDensity = 0.75;
+	const double LeafMinDensity = 0.125;
+	const double RootMinDensity = 0.25;
+
+	inline double densityBound(double leafBound, double rootBound, uint32_t depth, uint32_t treeDepth)
+	{
+		if (treeDepth == 0)
+			return rootBound;
+		return rootBound + (leafBound - rootBound) * std::min(depth, treeDepth) / treeDepth;
+	}
+}
+
+template <uint32_t Dim, typename Coord>
+uint32_t KdTree<Dim, Coord>::insert(const Point& p)
+{
+	if (m_Nodes.empty())
+		throw std::logic_error("KdTree has not been built.");
+	if (m_PointCount >= Node::MaxPayload)
+		throw std::logic_error("Too many points for a KdTree.");
+
+	trackPositions(size());
+	uint32_t id = (uint32_t)m_Positions.size();
+	m_Positions.push_back(InvalidIndex);
+	if (!m_NameOffsets.empty() || !p.m_name.empty())
+	{
+		// The ids given out before the first name have empty ones.
+		if (m_NameOffsets.empty())
+			m_NameOffsets.resize((size_t)id + 1);
+		appendName(p.m_name);
+	}
+	for (uint32_t j = 0; j < Dim; j++)
+	{
+		m_AABB.min[j] = std::min(m_AABB.min[j], p[j]);
+		m_AABB.max[j] = std::max(m_AABB.max[j], p[j]);
+	}
+	m_PointCount++;
+
+	std::vector<PathEntry> path;
+	findPath(p.m_coords, path);
+	Node& leaf = m_Nodes[path.back().node];
+
+	// The leaf's spare positions run up to the first position of the next leaf.
+	uint32_t spareEnd = size();
+	for (size_t i = path.size() - 1; i-- > 0;)
+	{
+		if (path[i + 1].node == path[i].node + 1)
+		{
+			const Node* next = &m_Nodes[path[i].node] + m_Nodes[path[i].node].rightOffset();
+			while (!next->isLeaf())
+				next = next->left();
+			spareEnd = next->begin;
+			break;
+		}
+	}
+
+	// Leaves of coincident points cannot be split, whatever their size, so they may grow past the capacity.
+	uint32_t position = leaf.begin + leaf.count();
+	bool hasRoom = leaf.count() < m_LeafCapacity;
+	for (uint32_t i = leaf.begin; !hasRoom && i < position && isAt(i, p.m_coords); i++)
+		hasRoom = i + 1 == position;
+	if (hasRoom && position < spareEnd)
+	{
+		for (uint32_t j = 0; j < Dim; j++)
+			m_Coords[j][position] = p[j];
+		m_Ids[position] = id;
+		m_Positions[id] = position;
+		leaf = Node::makeLeaf(leaf.begin, leaf.count() + 1);
+		return id;
+	}
+
+	// Rebuild the smallest subtree above the leaf that has room to spare, or else the whole tree with more room.
+	findPathPositions(path);
+	for (uint32_t depth = (uint32_t)path.size() - 1; depth-- > 0;)
+	{
+		const PathEntry& entry = path[depth];
+		uint32_t count = countPoints(entry.node, entry.nodeEnd) + 1;
+		if (count <= densityBound(LeafMaxDensity, RootMaxDensity, depth, m_Depth) * (entry.end - entry.begin)
+			&& rebuildSubtree(entry, depth, p.m_coords, id, entry.end - entry.begin))
+			return id;
+	}
+	rebuildSubtree(path[0], 0, p.m_coords, id, 2 * m_PointCount);
+	return id;
+}
+
+template <uint32_t Dim, typename Coord>
+bool KdTree<Dim, Coord>::erase(uint32_t id)
+{
+	if (m_Nodes.empty())
+		return false;
+
+	trackPositions(size());
+	if (id >= m_Positions.size() || m_Positions[id] == InvalidIndex)
+		return false;
+
+	uint32_t position = m_Positions[id];
+	Coord q[Dim];
+	for (uint32_t j = 0; j < Dim; j++)
+		q[j] = m_Coords[j][position];
+
+	std::vector<PathEntry> path;
+	findPath(q, path);
+	Node& leaf = m_Nodes[path.back().node];
+
+	// Keep the leaf's points contiguous by moving its last point into the gap.
+	uint32_t last = leaf.begin + leaf.count() - 1;
+	if (position != last)
+	{
+		for (uint32_t j = 0; j < Dim; j++)
+			m_Coords[j][position] = m_Coords[j][last];
+		m_Ids[position] = m_Ids[last];
+		m_Positions[m_Ids[position]] = position;
+	}
+	m_Ids[last] = InvalidIndex;
+	m_Positions[id] = InvalidIndex;
+	leaf = Node::makeLeaf(leaf.begin, leaf.count() - 1);
+	m_PointCount--;
+
+	// Shrink the tree once mostly spare. Otherwise only empty leaves are worth a rebuild, which merges them with their
+	// neighbors. The smallest subtree above that is dense enough is rebuilt, if it has room for the new nodes.
+	if (m_PointCount < RootMinDensity * size())
+	{
+		findPathPositions(path);
+		rebuildSubtree(path[0], 0, nullptr, InvalidIndex, 2 * m_PointCount);
+	}
+	else if (leaf.count() == 0)
+	{
+		findPathPositions(path);
+		for (uint32_t depth = (uint32_t)path.size() - 1; depth-- > 1;)
+		{
+			const PathEntry& entry = path[depth];
+			uint32_t count = countPoints(entry.node, entry.nodeEnd);
+			if (count >= densityBound(LeafMinDensity, RootMinDensity, depth, m_Depth) * (entry.end - entry.begin)
+				&& rebuildSubtree(entry, depth, nullptr, InvalidIndex, entry.end - entry.begin))
+				break;
+		}
+	}
+	return true;
+}
+
+template <uint32_t Dim, typename Coord>
+void KdTree<Dim, Coord>::findPath(const Coord* q, std::vector<PathEntry>& path) const
+{
+	path.clear();
+	path.reserve(m_Depth + 1);
+
+	uint32_t node = 0;
+	uint32_t nodeEnd = (uint32_t)m_Nodes.size();
+	for (;;)
+	{
+		path.push_back(PathEntry{ node, nodeEnd, 0, 0 });
+		const Node& current = m_Nodes[node];
+		if (current.isLeaf())
+			return;
+
+		uint32_t right = node + current.rightOffset();
+		if (q[current.axis()] < current.value)
+		{
+			nodeEnd = right;
+			node = node + 1;
+		}
+		else
+			node = right;
+	}
+}
+
+template <uint32_t Dim, typename Coord>
+void KdTree<Dim, Coord>::findPathPositions(std::vector<PathEntry>& path) const
+{
+	// A subtree's positions start with its leftmost leaf and end where the next subtree's do.
+	path[0].begin = 0;
+	path[0].end = size();
+	for (size_t i = 1; i < path.size(); i++)
+	{
+		const PathEntry& parent = path[i - 1];
+		const Node* right = &m_Nodes[parent.node] + m_Nodes[parent.node].rightOffset();
+		while (!right->isLeaf())
+			right = right->left();
+
+		if (path[i].node == parent.node + 1)
+		{
+			path[i].begin = parent.begin;
+			path[i].end = right->begin;
+		}
+		else
+		{
+			path[i].begin = right->begin;
+			path[i].end = parent.end;
+		}
+	}
+}
+
+template <uint32_t Dim, typename Coord>
+uint32_t KdTree<Dim, Coord>::countPoints(uint32_t begin, uint32_t end) const
+{
+	// Nodes left over from rebuilds are empty leaves, so they can be counted along.
+	uint32_t count = 0;
+	for (uint32_t i = begin; i < end; i++)
+	{
+		if (m_Nodes[i].isLeaf())
+			count += m_Nodes[i].count();
+	}
+	return count;
+}
+
+template <uint32_t Dim, typename Coord>
+void KdTree<Dim, Coord>::trackPositions(uint32_t idCount)
+{
+	if (!m_Positions.empty())
+		return;
+
+	// Read only, so that ids still mapped from a snapshot stay so.
+	const MappedArray<uint32_t>& ids = m_Ids;
+	m_Positions.assign(idCount, InvalidIndex);
+	for (uint32_t i = 0; i < size(); i++)
+	{
+		if (ids[i] != InvalidIndex)
+			m_Positions[ids[i]] = i;
+	}
+}
+
+template <uint32_t Dim, typename Coord>
+bool KdTree<Dim, Coord>::rebuildSubtree(const PathEntry& entry, uint32_t depth, const Coord* extra, uint32_t extraId, uint32_t positionCount)
+{
+	const bool isRoot = entry.node == 0;
+
+	// Gather the subtree's points, and their AABB.
+	AABB aabb;
+	for (uint32_t j = 0; j < Dim; j++)
+	{
+		aabb.min[j] = std::numeric_limits<Coord>::max();
+		aabb.max[j] = std::numeric_limits<Coord>::lowest();
+	}
+	auto gather = [&](const Coord* coords, uint32_t id)
+	{
+		BuildPoint point;
+		for (uint32_t j = 0; j < Dim; j++)
+		{
+			point.coords[j] = coords[j];
+			aabb.min[j] = std::min(aabb.min[j], coords[j]);
+			aabb.max[j] = std::max(aabb.max[j], coords[j]);
+		}
+		point.id = id;
+		m_BuildPoints.push_back(point);
+	};
+	m_BuildPoints.clear();
+	for (uint32_t i = entry.begin; i < entry.end; i++)
+	{
+		if (m_Ids[i] == InvalidIndex)
+			continue;
+		Coord coords[Dim];
+		ForEachAxis<Dim>::run([&](uint32_t j) { coords[j] = m_Coords[j][i]; });
+		gather(coords, m_Ids[i]);
+	}
+	if (extra)
+		gather(extra, extraId);
+
+	// Leaves are built with room to grow into their spare positions, so that the subtree needs about as many nodes
+	// whatever the share of its positions holding a point. Subtrees that would clearly not fit are not built at all.
+	const uint64_t count = m_BuildPoints.size();
+	const uint32_t leafCapacity = positionCount == 0 ? 1 : std::max(1u, (uint32_t)(m_LeafCapacity * count / positionCount));
+	if (!isRoot && balancedNodeCount((uint32_t)count, leafCapacity) > entry.nodeEnd - entry.node)
+	{
+		releaseBuildState();
+		return false;
+	}
+	std::vector<Node> nodes;
+	buildNodes(aabb, leafCapacity, nodes);
+	if (!isRoot && nodes.size() > entry.nodeEnd - entry.node)
+	{
+		releaseBuildState();
+		return false;
+	}
+
+	uint32_t begin = entry.begin;
+	uint32_t end = entry.end;
+	if (isRoot)
+	{
+		begin = 0;
+		end = positionCount;
+		for (uint32_t j = 0; j < Dim; j++)
+			m_Coords[j].resize(positionCount);
+		m_Ids.resize(positionCount);
+		m_Nodes.resize(nodes.size());
+		if (!m_BuildPoints.empty())
+			m_AABB = aabb;
+	}
+	std::fill(m_Ids.begin() + begin, m_Ids.begin() + end, InvalidIndex);
+
+	// Each leaf gets a share of the positions in proportion to its points. Those it does not fill are its spare ones.
+	const uint64_t span = end - begin;
+	for (size_t i = 0; i < nodes.size(); i++)
+	{
+		const Node& node = nodes[i];
+		if (!node.isLeaf())
+		{
+			m_Nodes[entry.node + i] = node;
+			continue;
+		}
+
+		uint32_t leafBegin = begin + (uint32_t)(count == 0 ? 0 : node.begin * span / count);
+		for (uint32_t k = 0; k < node.count(); k++)
+		{
+			const BuildPoint& point = builtPoint(node.begin + k);
+			ForEachAxis<Dim>::run([&](uint32_t j) { m_Coords[j][leafBegin + k] = point.coords[j]; });
+			m_Ids[leafBegin + k] = point.id;
+			m_Positions[point.id] = leafBegin + k;
+		}
+		m_Nodes[entry.node + i] = Node::makeLeaf(leafBegin, node.count());
+	}
+	// Nodes the subtree no longer needs are left unreachable, as empty leaves.
+	for (size_t i = entry.node + nodes.size(); i < entry.nodeEnd && !isRoot; i++)
+		m_Nodes[i] = Node::makeLeaf(begin, 0);
+
+	m_Depth = isRoot ? treeDepth(m_Nodes.data(), m_Nodes.size()) : std::max(m_Depth, depth + treeDepth(nodes.data(), nodes.size()));
+	releaseBuildState();
+	return true;
+}
+
+#ifdef KDTREE_PARALLEL_BUILD
+template <uint32_t Dim, typename Coord>
+void KdTree<Dim, Coord>::spliceNodeBuffer(const NodeBuffer& buffer, std::vector<Node>& out)
+{
+	const std::vector<Node>& nodes = buffer.nodes;
+	if (!buffer.hasPlaceholders)
+	{
+		// Child offsets are relative, so the subtree can be copied as is.
+		out.insert(out.end(), nodes.begin(), nodes.end());
+		return;
+	}
+
+	// Placeholders grow into whole subtrees, moving right children further away from their parents.
+	std::vector<uint32_t> positions(nodes.size());
+	for (size_t i = 0; i < nodes.size(); i++)
+	{
+		positions[i] = (uint32_t)out.size();
+		if (nodes[i].isLeaf() && nodes[i].count() == 0)
+			spliceNodeBuffer(m_ParallelBuild->buffers[nodes[i].begin], out);
+		else
+			out.push_back(nodes[i]);
+	}
+
+	for (size_t i = 0; i < nodes.size(); i++)
+	{
+		if (!nodes[i].isLeaf())
+			out[positions[i]] = Node::makeInner(nodes[i].axis(), nodes[i].value, positions[i + nodes[i].rightOffset()] - positions[i]);
+	}
+}
+#endif
+
+template <uint32_t Dim, typename Coord>
+template <typename CoordAt>
+uint32_t KdTree<Dim, Coord>::tuneLeafCapacity(uint32_t count, CoordAt coordAt, BuildMode mode)
+{
+	// Small leaves mean deep trees and many nodes visited per query, large ones more points scanned per leaf.
+	// Where the balance lies depends on the data and on the leaf scan kernel, so it is measured.
+	const uint32_t candidates[] = { 4, 8, 16, 32, 64, 128, 256 };
+	const size_t sampleSize = 1 << 16;
+	const size_t querySize = 1 << 12;
+
+	// An evenly spread sample, without names: they play no part in the timings.
+	size_t stride = std::max<size_t>(1, count / sampleSize);
+	std::vector<Point> sample;
+	sample.reserve(std::min<size_t>(count, sampleSize));
+	for (size_t i = 0; i < count && sample.size() < sampleSize; i += stride)
+	{
+		sample.emplace_back();
+		ForEachAxis<Dim>::run([&](uint32_t j) { sample.back()[j] = coordAt((uint32_t)i, j); });
+	}
+
+	size_t queryStride = std::max<size_t>(1, sample.size() / querySize);
+	uint32_t best = candidates[0];
+	double bestTime = std::numeric_limits<double>::max();
+	KdTree tree;
+
+	for (uint32_t capacity : candidates)
+	{
+		tree.build(capacity, sample, mode);
+
+		auto start = std::chrono::steady_clock::now();
+		for (uint32_t i = 0; i < tree.size(); i += (uint32_t)queryStride)
+		{
+			Distance distSq = CoordTraits<Coord>::maxDistance();
+			uint32_t nearest = InvalidIndex;
+			tree.nearestNeighborSearch(tree.location(i), i, nearest, distSq, 1.0);
+		}
+		double time = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+		if (time < bestTime)
+		{
+			bestTime = time;
+			best = capacity;
+		}
+	}
+	return best;
+}
+
+template <uint32_t Dim, typename Coord>
+uint32_t KdTree<Dim, Coord>::treeDepth(const Node* nodes, size_t count)
+{
+	// Children always come after their parent, so a single pass settles the depth of every node.
+	std::vector<uint32_t> depths(count, 0);
+	uint32_t depth = 0;
+	for (size_t i = 0; i < count; i++)
+	{
+		if (nodes[i].isLeaf())
+			continue;
+
+		// The deepest path counts, should a damaged snapshot give a node more than one parent.
+		depths[i + 1] = std::max(depths[i + 1], depths[i] + 1);
+		depths[i + nodes[i].rightOffset()] = std::max(depths[i + nodes[i].rightOffset()], depths[i] + 1);
+		depth = std::max(depth, depths[i] + 1);
+	}
+	return depth;
+}
+
+template <uint32_t Dim, typename Coord>
+uint32_t KdTree<Dim, Coord>::balancedNodeCount(uint32_t count, uint32_t leafCapacity)
+{
+	// Every split divides a range in halves that differ by at most one point, so each level of
+	// the tree only holds ranges of two consecutive sizes: small and small + 1.
+	uint32_t nodes = 0;
+	uint32_t small = count;
+	uint32_t smallCount = 1;
+	uint32_t largeCount = 0;
+
+	while (smallCount + largeCount > 0)
+	{
+		nodes += smallCount + largeCount;
+
+		uint32_t nextSmall = small / 2;
+		uint32_t nextSmallCount = 0;
+		uint32_t nextLargeCount = 0;
+
+		// A range of size n splits into n / 2 and n - n / 2 points.
+		if (small > leafCapacity)
+		{
+			if (small % 2 == 0)
+				nextSmallCount += 2 * smallCount;
+			else
+			{
+				nextSmallCount += smallCount;
+				nextLargeCount += smallCount;
+			}
+		}
+		if (small + 1 > leafCapacity)
+		{
+			if ((small + 1) % 2 == 0)
+				nextLargeCount += 2 * largeCount;
+			else
+			{
+				nextSmallCount += largeCount;
+				nextLargeCount += largeCount;
+			}
+		}
+
+		small = nextSmall;
+		smallCount = nextSmallCount;
+		largeCount = nextLargeCount;
+	}
+
+	return nodes;
+}
+
+template <uint32_t Dim, typename Coord>
+bool KdTree<Dim, Coord>::splitSelect(uint32_t begin, uint32_t end, uint32_t axis, uint32_t& mid, Coord& value)
+{
+	BuildPoint* points = m_BuildPoints.data();
+
+	mid = begin + (end - begin) / 2;
+	selectBuildPoint(begin, end, mid, axis);
+	value = points[mid].coords[axis];
+
+	// Points on the splitting plane may lie on both sides of the median. Those are moved to the right.
+	Coord pivot = value;
+	mid = partitionBuildPoints(begin, mid, [axis, pivot](const BuildPoint& p) { return p.coords[axis] < pivot; });
+	if (mid > begin)
+		return true;
+
+	// The median is the smallest value in the range. Put all points having it on the left instead
+	// and split at the next value.
+	mid = partitionBuildPoints(begin, end, [axis, pivot](const BuildPoint& p) { return p.coords[axis] <= pivot; });
+	if (mid == end)
+		return false;
+
+	value = std::min_element(points + mid, points + end, [axis](const BuildPoint& a, const BuildPoint& b) { return a.coords[axis] < b.coords[axis]; })->coords[axis];
+	return true;
+}
+
+template <uint32_t Dim, typename Coord>
+template <typename Predicate>
+uint32_t KdTree<Dim, Coord>::partitionBuildPoints(uint32_t begin, uint32_t end, Predicate pred)
 {
-	freeNodes(m_Root);
+	BuildPoint* points = m_BuildPoints.data();
+#ifdef KDTREE_PARALLEL_BUILD
+	if (end - begin > ParallelPartitionCutoff)
+		return parallelStablePartition(m_ParallelBuild->pool, points, m_ParallelBuild->partitionScratch.data(), begin, end, pred);
+#endif
+	return (uint32_t)(std::partition(points + begin, points + end, pred) - points);
 }
 
-void KdTree::build(uint8_t leafCapacity, const std::vector<Point>& points)
+template <uint32_t Dim, typename Coord>
+void KdTree<Dim, Coord>::selectBuildPoint(uint32_t begin, uint32_t end, uint32_t nth, uint32_t axis)
 {
-	if (points.empty())
+	BuildPoint* points = m_BuildPoints.data();
+
+#ifdef KDTREE_PARALLEL_BUILD
+	// Quickselect with three-way partitions, each done in parallel, until the range is small enough for nth_element.
+	while (end - begin > ParallelPartitionCutoff)
 	{
-		std::cout << "Empty point set. Will not build." << std::endl;
-		return;
+		// Pivot on the median of evenly spaced samples.
+		const uint32_t sampleCount = 255;
+		Coord samples[sampleCount];
+		for (uint32_t i = 0; i < sampleCount; i++)
+			samples[i] = points[begin + (uint32_t)((uint64_t)(end - begin) * i / sampleCount)].coords[axis];
+		std::nth_element(samples, samples + sampleCount / 2, samples + sampleCount);
+		Coord pivot = samples[sampleCount / 2];
+
+		uint32_t lessEnd = partitionBuildPoints(begin, end, [axis, pivot](const BuildPoint& p) { return p.coords[axis] < pivot; });
+		uint32_t equalEnd = partitionBuildPoints(lessEnd, end, [axis, pivot](const BuildPoint& p) { return p.coords[axis] == pivot; });
+
+		if (nth < lessEnd)
+			end = lessEnd;
+		else if (nth >= equalEnd)
+			begin = equalEnd;
+		// The nth point is on the pivot, with all smaller points before it and all greater ones after it.
+		else
+			return;
 	}
+#endif
 
-	m_LeafCapacity = leafCapacity == 0 ? 1 : leafCapacity;;
-	m_Points = points;
+	std::nth_element(points + begin, points + nth, points + end, [axis](const BuildPoint& a, const BuildPoint& b) { return a.coords[axis] < b.coords[axis]; });
+}
 
-	// Find bounding box containing all points.
-	m_AABB.min = Point(std::numeric_limits<int32_t>::max(), std::numeric_limits<int32_t>::max());
-	m_AABB.max = Point(std::numeric_limits<int32_t>::min(), std::numeric_limits<int32_t>::min());
-	for (size_t i = 0; i < m_Points.size(); i++)
+template <uint32_t Dim, typename Coord>
+bool KdTree<Dim, Coord>::splitPresorted(uint32_t begin, uint32_t end, uint32_t axis, uint32_t& mid, Coord& value)
+{
+	const uint32_t* sorted = m_Sorted[axis].data();
+
+	// The range is sorted along the axis, so points on the splitting plane are contiguous. They are moved to the right,
+	// unless that would leave the left empty, in which case they all go to the left.
+	mid = begin + (end - begin) / 2;
+	Coord pivot = presortedCoord(sorted[mid], axis);
+	while (mid > begin && presortedCoord(sorted[mid - 1], axis) == pivot)
+		mid--;
+	if (mid == begin)
 	{
-		for (size_t j = 0; j < 2; j++)
-		{
-			if (m_Points[i][j] < m_AABB.min[j])
-				m_AABB.min[j] = m_Points[i][j];
-			if (m_Points[i][j] > m_AABB.max[j])
-				m_AABB.max[j] = m_Points[i][j];
-		}
+		while (mid < end && presortedCoord(sorted[mid], axis) == pivot)
+			mid++;
+		if (mid == end)
+			return false;
 	}
+	value = presortedCoord(sorted[mid], axis);
 
-	freeNodes(m_Root);
-
-	// Build tree recursevily.
-	m_Root = buildRecursive(0, (uint32_t)m_Points.size(), m_AABB, 0);
+	// Stable partition of the other axes, so that they stay sorted within both halves.
+	for (uint32_t other = 0; other < Dim; other++)
+	{
+		if (other == axis)
+			continue;
 
+		uint32_t* indices = m_Sorted[other].data();
+		uint32_t* scratch = m_PartitionScratch.data();
 #ifdef KDTREE_PARALLEL_BUILD
-	// Wait for async builds.
-	for (size_t i = 0; i < asyncBuilds.size(); i++)
-		asyncBuilds[i].wait();
-	asyncBuilds.clear();
+		if (end - begin > ParallelPartitionCutoff)
+		{
+			parallelStablePartition(m_ParallelBuild->pool, indices, scratch, begin, end, [this, axis, value](uint32_t i) { return presortedCoord(i, axis) < value; });
+			continue;
+		}
 #endif
+		uint32_t left = begin;
+		uint32_t right = begin;
+		for (uint32_t i = begin; i < end; i++)
+		{
+			if (presortedCoord(indices[i], axis) < value)
+				indices[left++] = indices[i];
+			else
+				scratch[right++] = indices[i];
+		}
+		std::copy(scratch + begin, scratch + right, indices + left);
+	}
+
+	return true;
 }
 
-KdTreeNode* KdTree::buildRecursive(uint32_t begin, uint32_t end, AABB aabb, int depth)
+template <uint32_t Dim, typename Coord>
+uint32_t KdTree<Dim, Coord>::buildRecursive(uint32_t begin, uint32_t end, AABB aabb, NodeBuffer& buffer)
 {
-	KdTreeNode* node = new KdTreeNode();
+	std::vector<Node>& nodes = buffer.nodes;
+
+	// Nodes are referenced by index since the buffer may grow while the children are built.
+	uint32_t index = (uint32_t)nodes.size();
+	nodes.emplace_back();
 
 	uint32_t count = end - begin;
 	// Reached the leaf capacity. Create leaf node.
-	if (count <= (uint32_t)m_LeafCapacity)
+	if (count <= m_BuildLeafCapacity)
 	{	
-		node->begin = begin;
-		node->count = (uint8_t)count;
-		return node;
+		nodes[index] = Node::makeLeaf(begin, count);
+		return index;
 	}
 
 	// We are going to split the node in the axis with largest bound size.
-	node->axis = aabb.size().m_x > aabb.size().m_y ? 0 : 1;
-
-	// The points are then sorted based on the chosen axis.
-	if (node->axis == 0)
-		std::sort(m_Points.begin() + begin, m_Points.begin() + end, [](Point a, Point b) {return a.m_x < b.m_x;});
-	else
-		std::sort(m_Points.begin() + begin, m_Points.begin() + end, [](Point a, Point b) {return a.m_y < b.m_y;});
+	// Extents are compared in double, since they may not fit the coordinate type.
+	uint32_t firstAxis = 0;
+	double largest = -1.0;
+	for (uint32_t i = 0; i < Dim; i++)
+	{
+		double extent = (double)aabb.max[i] - (double)aabb.min[i];
+		if (extent >= largest)
+		{
+			largest = extent;
+			firstAxis = i;
+		}
+	}
 
 	// Points are split in half. The mid point will be contained by the right node.
-	uint32_t mid = begin + static_cast<uint32_t>(std::floor(count * 0.5));
+	// Colinear points will remain on the right node, unless they fill it entirely.
+	uint32_t mid;
+	Coord value;
+	auto split = [&](uint32_t axis) { return m_BuildMode == BuildMode::Presort ? splitPresorted(begin, end, axis, mid, value) : splitSelect(begin, end, axis, mid, value); };
 
-	// Colinear points will remain on the right node.
-	bool forceRightLeave = end - mid <= (uint32_t)m_LeafCapacity;
-	while (mid > begin)
+	// If all points are colinear along the axis, try the other ones.
+	uint32_t axis = firstAxis;
+	uint32_t attempt = 0;
+	while (!split(axis))
 	{
-		if (m_Points[mid][node->axis] != m_Points[mid - 1][node->axis])
-			break;
-		mid--;
+		// All points coincide. They can only be stored in a single leaf, above capacity.
+		if (++attempt == Dim)
+		{
+			nodes[index] = Node::makeLeaf(begin, count);
+			return index;
+		}
+		axis = (firstAxis + attempt) % Dim;
 	}
 
-	node->value = m_Points[mid][node->axis];
+	// The right node should have been a leaf. Keep it one, even if colinear points pushed it above capacity.
+	bool forceRightLeave = end - (begin + count / 2) <= m_BuildLeafCapacity;
 
 	// Update bounding box.
 	AABB aabbLeft = aabb;
 	AABB aabbRight = aabb;
 
-	aabbLeft.max[node->axis] = aabbRight.min[node->axis] = node->value;
+	aabbLeft.max[axis] = aabbRight.min[axis] = value;
 
 	// Create children.
-	//
-	// This is a quick solution to provide parallel tree builds.
-	// A more elaborated solution would be preferred though as this does not accounts for the number of
-	// logical processors and the size of the input.
-	// This will spawn four async jobs, where each one builds a different subtree on a separated thread.
+	// The left child always follows its parent.
+	uint32_t right;
 #ifdef KDTREE_PARALLEL_BUILD
-	if (depth == 2)
+	if (!forceRightLeave && end - mid > ParallelBuildCutoff)
 	{
-		auto buildAndAssign = [this](KdTreeNode** node, uint32_t begin, uint32_t end, AABB aabb, int depth) { *node = buildRecursive(begin, end, aabb, depth); };
-		asyncBuilds.emplace_back(std::async(std::launch::async, buildAndAssign, &node->left,	begin,	mid, aabbLeft,	depth + 1));
-		asyncBuilds.emplace_back(std::async(std::launch::async, buildAndAssign, &node->right,	mid,	end, aabbRight, depth + 1));
+		// The right subtree is built by another task, into its own buffer, while this one goes on with the left.
+		NodeBuffer* rightBuffer;
+		uint32_t rightBufferIndex;
+		{
+			std::lock_guard<std::mutex> lock(m_ParallelBuild->buffersMutex);
+			rightBufferIndex = (uint32_t)m_ParallelBuild->buffers.size();
+			m_ParallelBuild->buffers.emplace_back();
+			rightBuffer = &m_ParallelBuild->buffers.back();
+		}
+		m_ParallelBuild->pool.run(m_ParallelBuild->tasks, [this, mid, end, aabbRight, rightBuffer]() { buildRecursive(mid, end, aabbRight, *rightBuffer); });
+
+		buildRecursive(begin, mid, aabbLeft, buffer);
+
+		// A leaf without points is a placeholder. It holds the index of the buffer in place of the first point.
+		right = (uint32_t)nodes.size();
+		nodes.push_back(Node::makeLeaf(rightBufferIndex, 0));
+		buffer.hasPlaceholders = true;
 	}
 	else
 #endif
 	{
-		node->left = buildRecursive(begin, mid, aabbLeft, depth + 1);
+		buildRecursive(begin, mid, aabbLeft, buffer);
 		// Leaf capacity may not be reached if we move the mid index.
 		// Must account for that.
 		if (forceRightLeave)
 		{
-			node->right = new KdTreeNode();
-			node->right->begin = mid;
-			node->right->count = (uint8_t)(end - mid);
+			right = (uint32_t)nodes.size();
+			nodes.push_back(Node::makeLeaf(mid, end - mid));
 		}
 		else
-			node->right = buildRecursive(mid, end, aabbRight, depth + 1);
+			right = buildRecursive(mid, end, aabbRight, buffer);
+	}
+
+	nodes[index] = Node::makeInner(axis, value, right - index);
+	return index;
+}
+
+namespace
+{
+	// Whether a region at regionDistSq from the query still needs to be searched, given the squared distance to the
+	// current candidate. Exact when pruneScale is 1, in which case regions just as far are searched too if reachTies,
+	// as they may hold a point at the same distance with a lower position.
+	template <typename Distance>
+	inline bool withinReach(Distance regionDistSq, Distance distSq, double pruneScale, bool reachTies)
+	{
+		if (pruneScale == 1.0)
+			return reachTies ? regionDistSq <= distSq : regionDistSq < distSq;
+		return (double)regionDistSq * pruneScale < (double)distSq;
 	}
+}
 
-	return node;
+template <uint32_t Dim, typename Coord>
+double KdTree<Dim, Coord>::pruneScaleFor(double epsilon)
+{
+	if (!(epsilon >= 0.0))
+		throw std::logic_error("epsilon must not be negative.");
+
+	return (1.0 + epsilon) * (1.0 + epsilon);
 }
 
-Point KdTree::nearestNeighbor(Point p) const
+template <uint32_t Dim, typename Coord>
+typename KdTree<Dim, Coord>::Point KdTree<Dim, Coord>::nearestNeighbor(const Point& p, double epsilon) const
 {
-	if (m_Root == nullptr || m_Points.empty())
+	if (m_Nodes.empty())
 		throw std::logic_error("KdTree has not been built or is empty.");
 
-	double dist = std::numeric_limits<double>::max();
-	Point nearest;
+	Distance distSq = CoordTraits<Coord>::maxDistance();
+	uint32_t nearest = InvalidIndex;
+
+	nearestNeighborSearch(p, InvalidIndex, nearest, distSq, pruneScaleFor(epsilon));
+
+	return nearest == InvalidIndex ? Point() : point(nearest);
+}
+
+template <uint32_t Dim, typename Coord>
+void KdTree<Dim, Coord>::allNearestNeighbors(uint32_t* indices, double* distances, double epsilon) const
+{
+	if (m_Nodes.empty())
+		return;
+
+	const double pruneScale = pruneScaleFor(epsilon);
+	const uint32_t count = size();
+	// Points are handed out in chunks, each a separate task, so that threads which finish early can pick up more work.
+	// Each output entry only depends on its own query, so the result is the same regardless of scheduling.
+	const uint32_t chunkSize = 1024;
+	const uint32_t chunkCount = (count + chunkSize - 1) / chunkSize;
+
+	TaskPool::global().parallelFor(chunkCount, [&](uint32_t chunk)
+	{
+		uint32_t begin = chunk * chunkSize;
+		uint32_t end = std::min(count, begin + chunkSize);
+
+		for (uint32_t i = begin; i < end; i++)
+		{
+			Distance distSq = CoordTraits<Coord>::maxDistance();
+			uint32_t nearest = InvalidIndex;
+			if (m_Ids[i] != InvalidIndex)
+				nearestNeighborSearch(location(i), i, nearest, distSq, pruneScale);
+			indices[i] = nearest;
+			// The only square root taken per query.
+			distances[i] = nearest == InvalidIndex ? std::numeric_limits<double>::max() : std::sqrt((double)distSq);
+		}
+	});
+}
+
+namespace
+{
+	// Position of p along the Z-order curve over the box. Points outside the box are moved to its border.
+	// Each axis is quantized to the same number of bits, which are then interleaved, highest first.
+	template <uint32_t Dim, typename Coord>
+	inline uint64_t mortonCode(const BasicPoint<Dim, Coord>& p, const BasicAABB<Dim, Coord>& box)
+	{
+		const uint32_t bits = 64 / Dim < 32 ? 64 / Dim : 32;
+		const double cellCount = (double)((1ull << bits) - 1);
+
+		uint64_t cells[Dim];
+		for (uint32_t axis = 0; axis < Dim; axis++)
+		{
+			double extent = (double)box.max[axis] - (double)box.min[axis];
+			double offset = (double)std::min(std::max(p[axis], box.min[axis]), box.max[axis]) - (double)box.min[axis];
+			cells[axis] = extent > 0.0 ? (uint64_t)(offset / extent * cellCount) : 0;
+		}
+
+		uint64_t code = 0;
+		for (uint32_t bit = bits; bit-- > 0;)
+		{
+			for (uint32_t axis = Dim; axis-- > 0;)
+				code = (code << 1) | ((cells[axis] >> bit) & 1);
+		}
+		return code;
+	}
+}
+
+template <uint32_t Dim, typename Coord>
+void KdTree<Dim, Coord>::nearestNeighbors(const Point* queries, uint32_t count, uint32_t* indices, double* distances, double epsilon) const
+{
+	if (m_Nodes.empty() || count == 0)
+		return;
+
+	const double pruneScale = pruneScaleFor(epsilon);
+
+	// Sort the queries along the curve, keeping track of where each came from.
+	std::vector<std::pair<uint64_t, uint32_t>> order(count);
+	TaskPool::global().parallelFor((count + 4095) / 4096, [&](uint32_t chunk)
+	{
+		uint32_t end = std::min(count, (chunk + 1) * 4096);
+		for (uint32_t i = chunk * 4096; i < end; i++)
+			order[i] = std::make_pair(mortonCode(queries[i], m_AABB), i);
+	});
+	std::sort(order.begin(), order.end());
+
+	// Chunks are consecutive stretches of the curve, so each thread works on its own region of the tree.
+	const uint32_t chunkSize = 1024;
+	const uint32_t chunkCount = (count + chunkSize - 1) / chunkSize;
+
+	TaskPool::global().parallelFor(chunkCount, [&](uint32_t chunk)
+	{
+		uint32_t begin = chunk * chunkSize;
+		uint32_t end = std::min(count, begin + chunkSize);
+
+		for (uint32_t i = begin; i < end; i++)
+		{
+			uint32_t query = order[i].second;
+			Distance distSq = CoordTraits<Coord>::maxDistance();
+			uint32_t nearest = InvalidIndex;
+			nearestNeighborSearch(queries[query], InvalidIndex, nearest, distSq, pruneScale);
+			indices[query] = nearest;
+			distances[query] = nearest == InvalidIndex ? std::numeric_limits<double>::max() : std::sqrt((double)distSq);
+		}
+	});
+}
+
+template <uint32_t Dim, typename Coord>
+uint32_t KdTree<Dim, Coord>::nearestNeighborOf(uint32_t index, double& distance, double epsilon) const
+{
+	if (index >= size())
+		throw std::logic_error("Point index out of range.");
+	if (m_Ids[index] == InvalidIndex)
+		throw std::logic_error("No point at this position.");
 
-	nearestNeighborRecursive(m_Root, p, nearest, dist);
+	Distance distSq = CoordTraits<Coord>::maxDistance();
+	uint32_t nearest = InvalidIndex;
+	nearestNeighborSearch(location(index), index, nearest, distSq, pruneScaleFor(epsilon));
 
+	distance = nearest == InvalidIndex ? std::numeric_limits<double>::max() : std::sqrt((double)distSq);
 	return nearest;
 }
 
-void KdTree::nearestNeighborRecursive(const KdTreeNode* node, Point& p, Point& nearest, double& dist) const
+template <uint32_t Dim, typename Coord>
+uint32_t KdTree<Dim, Coord>::kNearestNeighbors(const Point& p, uint32_t k, uint32_t* indices, double* distances, double epsilon) const
 {
-	if (node->isLeaf())
+	if (m_Nodes.empty())
+		throw std::logic_error("KdTree has not been built or is empty.");
+
+	return kNearestNeighborsQuery(p, InvalidIndex, k, indices, distances, epsilon);
+}
+
+template <uint32_t Dim, typename Coord>
+uint32_t KdTree<Dim, Coord>::kNearestNeighborsOf(uint32_t index, uint32_t k, uint32_t* indices, double* distances, double epsilon) const
+{
+	if (index >= size())
+		throw std::logic_error("Point index out of range.");
+	if (m_Ids[index] == InvalidIndex)
+		throw std::logic_error("No point at this position.");
+
+	return kNearestNeighborsQuery(location(index), index, k, indices, distances, epsilon);
+}
+
+template <uint32_t Dim, typename Coord>
+uint32_t KdTree<Dim, Coord>::kNearestNeighborsQuery(const Point& p, uint32_t self, uint32_t k, uint32_t* indices, double* distances, double epsilon) const
+{
+	const double pruneScale = pruneScaleFor(epsilon);
+	if (k == 0)
+		return 0;
+
+	Distance stackDistSq[KnnStackCapacity];
+	std::vector<Distance> heapDistSq;
+	if (k > KnnStackCapacity)
+		heapDistSq.resize(k);
+
+	KnnCandidates candidates = { k > KnnStackCapacity ? heapDistSq.data() : stackDistSq, indices, k, 0 };
+	kNearestNeighborsSearch(p, self, candidates, pruneScale);
+
+	for (uint32_t i = 0; i < candidates.count; i++)
+		distances[i] = std::sqrt((double)candidates.distSq[i]);
+
+	return candidates.count;
+}
+
+template <uint32_t Dim, typename Coord>
+void KdTree<Dim, Coord>::allKNearestNeighbors(uint32_t k, uint32_t* indices, double* distances, double epsilon) const
+{
+	if (m_Nodes.empty() || k == 0)
+		return;
+
+	pruneScaleFor(epsilon);
+	const uint32_t count = size();
+	const uint32_t chunkSize = 256;
+	const uint32_t chunkCount = (count + chunkSize - 1) / chunkSize;
+
+	TaskPool::global().parallelFor(chunkCount, [&](uint32_t chunk)
 	{
-		// Naive search within leaf nodes
-		for (uint32_t i = node->begin; i < node->begin + node->count; i++)
+		uint32_t begin = chunk * chunkSize;
+		uint32_t end = std::min(count, begin + chunkSize);
+
+		for (uint32_t i = begin; i < end; i++)
 		{
-			if (m_Points[i] == p)
-				continue;
+			uint32_t* rowIndices = indices + (size_t)i * k;
+			double* rowDistances = distances + (size_t)i * k;
+
+			uint32_t found = m_Ids[i] == InvalidIndex ? 0 : kNearestNeighborsOf(i, k, rowIndices, rowDistances, epsilon);
+			for (uint32_t j = found; j < k; j++)
+			{
+				rowIndices[j] = InvalidIndex;
+				rowDistances[j] = std::numeric_limits<double>::max();
+			}
+		}
+	});
+}
+
+template <uint32_t Dim, typename Coord>
+void KdTree<Dim, Coord>::kNearestNeighborsSearch(const Point& p, uint32_t self, KnnCandidates& candidates, double pruneScale) const
+{
+	const Coord* q = p.m_coords;
+
+	auto scanLeaf = [&](const Node* leaf)
+	{
+		for (uint32_t i = leaf->begin; i < leaf->begin + leaf->count(); i++)
+		{
+			Distance d = squaredDistanceTo(i, q);
+			if (d < candidates.bound())
+			{
+				if (d == 0 && isQuery(i, p, self))
+					continue;
+				candidates.insert(d, i);
+			}
+		}
+	};
+	// A region is only searched if the circle through the k-th candidate reaches into it.
+	auto bound = [&candidates]() { return candidates.bound(); };
 
-			double d = (p - m_Points[i]).magnitude();
-			if (d < dist)
+	nearestFirstSearch(p, pruneScale, false, scanLeaf, bound);
+}
+
+namespace
+{
+	// The points within a circle, as searched by regionSearchRecursive.
+	template <uint32_t Dim, typename Coord>
+	struct CircleRegion
+	{
+		typedef CoordTraits<Coord> Traits;
+		typedef typename Traits::Distance Distance;
+
+		BasicPoint<Dim, Coord> center;
+		Distance radiusSq;
+
+		// Whether the circle misses the box, or contains it entirely. Measures the distances from the center to
+		// the nearest and farthest points of the box.
+		bool disjoint(const BasicAABB<Dim, Coord>& box) const
+		{
+			Distance distSq = 0;
+			for (uint32_t axis = 0; axis < Dim; axis++)
+			{
+				Coord nearest = std::min(std::max(center[axis], box.min[axis]), box.max[axis]);
+				distSq = Traits::add(distSq, Traits::squaredDifference(center[axis], nearest));
+			}
+			return distSq > radiusSq;
+		}
+		bool contains(const BasicAABB<Dim, Coord>& box) const
+		{
+			Distance distSq = 0;
+			for (uint32_t axis = 0; axis < Dim; axis++)
+			{
+				Coord farthest = (double)center[axis] - box.min[axis] > (double)box.max[axis] - center[axis] ? box.min[axis] : box.max[axis];
+				distSq = Traits::add(distSq, Traits::squaredDifference(center[axis], farthest));
+			}
+			return distSq <= radiusSq;
+		}
+		bool contains(const Coord* coords) const
+		{
+			Distance distSq = 0;
+			for (uint32_t axis = 0; axis < Dim; axis++)
+				distSq = Traits::add(distSq, Traits::squaredDifference(coords[axis], center[axis]));
+			return distSq <= radiusSq;
+		}
+	};
+
+	// The points within a box, bounds included, as searched by regionSearchRecursive.
+	template <uint32_t Dim, typename Coord>
+	struct BoxRegion
+	{
+		BasicAABB<Dim, Coord> box;
+
+		bool disjoint(const BasicAABB<Dim, Coord>& other) const
+		{
+			for (uint32_t axis = 0; axis < Dim; axis++)
+			{
+				if (other.max[axis] < box.min[axis] || other.min[axis] > box.max[axis])
+					return true;
+			}
+			return false;
+		}
+		bool contains(const BasicAABB<Dim, Coord>& other) const
+		{
+			for (uint32_t axis = 0; axis < Dim; axis++)
 			{
-				dist = d;
-				nearest = m_Points[i];
+				if (other.min[axis] < box.min[axis] || other.max[axis] > box.max[axis])
+					return false;
 			}
+			return true;
+		}
+		bool contains(const Coord* coords) const
+		{
+			for (uint32_t axis = 0; axis < Dim; axis++)
+			{
+				if (coords[axis] < box.min[axis] || coords[axis] > box.max[axis])
+					return false;
+			}
+			return true;
+		}
+	};
+}
+
+template <uint32_t Dim, typename Coord>
+void KdTree<Dim, Coord>::radiusSearch(const Point& p, double r, std::vector<uint32_t>& indices) const
+{
+	Distance radiusSq;
+	if (m_Nodes.empty() || !CoordTraits<Coord>::radiusToSquared(r, radiusSq))
+		return;
+
+	auto emit = [&indices](uint32_t begin, uint32_t end)
+	{
+		for (uint32_t i = begin; i < end; i++)
+			indices.push_back(i);
+	};
+	regionSearchRecursive(m_Nodes.data(), m_AABB, CircleRegion<Dim, Coord>{ p, radiusSq }, emit);
+}
+
+template <uint32_t Dim, typename Coord>
+uint32_t KdTree<Dim, Coord>::radiusCount(const Point& p, double r) const
+{
+	Distance radiusSq;
+	if (m_Nodes.empty() || !CoordTraits<Coord>::radiusToSquared(r, radiusSq))
+		return 0;
+
+	uint32_t count = 0;
+	auto emit = [&count](uint32_t begin, uint32_t end) { count += end - begin; };
+	regionSearchRecursive(m_Nodes.data(), m_AABB, CircleRegion<Dim, Coord>{ p, radiusSq }, emit);
+	return count;
+}
+
+template <uint32_t Dim, typename Coord>
+void KdTree<Dim, Coord>::radiusSearch(const Point* queries, uint32_t queryCount, double r, std::vector<uint64_t>& offsets, std::vector<uint32_t>& indices) const
+{
+	offsets.assign((size_t)queryCount + 1, 0);
+	indices.clear();
+
+	Distance radiusSq;
+	if (m_Nodes.empty() || !CoordTraits<Coord>::radiusToSquared(r, radiusSq))
+		return;
+
+	const uint32_t chunkSize = 256;
+	const uint32_t chunkCount = (queryCount + chunkSize - 1) / chunkSize;
+
+	// Counting is cheap, as contained subtrees are counted whole, so the results are counted first and then written
+	// straight to their final place. Keeps the output independent of the scheduling.
+	TaskPool::global().parallelFor(chunkCount, [&](uint32_t chunk)
+	{
+		uint32_t begin = chunk * chunkSize;
+		uint32_t end = std::min(queryCount, begin + chunkSize);
+
+		for (uint32_t i = begin; i < end; i++)
+		{
+			uint32_t count = 0;
+			auto emit = [&count](uint32_t rangeBegin, uint32_t rangeEnd) { count += rangeEnd - rangeBegin; };
+			regionSearchRecursive(m_Nodes.data(), m_AABB, CircleRegion<Dim, Coord>{ queries[i], radiusSq }, emit);
+			offsets[i + 1] = count;
+		}
+	});
+
+	for (uint32_t i = 0; i < queryCount; i++)
+		offsets[i + 1] += offsets[i];
+	indices.resize(offsets[queryCount]);
+
+	TaskPool::global().parallelFor(chunkCount, [&](uint32_t chunk)
+	{
+		uint32_t begin = chunk * chunkSize;
+		uint32_t end = std::min(queryCount, begin + chunkSize);
+
+		for (uint32_t i = begin; i < end; i++)
+		{
+			uint32_t* out = indices.data() + offsets[i];
+			auto emit = [&out](uint32_t rangeBegin, uint32_t rangeEnd)
+			{
+				for (uint32_t j = rangeBegin; j < rangeEnd; j++)
+					*out++ = j;
+			};
+			regionSearchRecursive(m_Nodes.data(), m_AABB, CircleRegion<Dim, Coord>{ queries[i], radiusSq }, emit);
+		}
+	});
+}
+
+template <uint32_t Dim, typename Coord>
+void KdTree<Dim, Coord>::rangeQuery(const AABB& box, std::vector<uint32_t>& indices) const
+{
+	if (m_Nodes.empty())
+		return;
+
+	auto emit = [&indices](uint32_t begin, uint32_t end)
+	{
+		for (uint32_t i = begin; i < end; i++)
+			indices.push_back(i);
+	};
+	regionSearchRecursive(m_Nodes.data(), m_AABB, BoxRegion<Dim, Coord>{ box }, emit);
+}
+
+template <uint32_t Dim, typename Coord>
+uint32_t KdTree<Dim, Coord>::rangeCount(const AABB& box) const
+{
+	if (m_Nodes.empty())
+		return 0;
+
+	uint32_t count = 0;
+	auto emit = [&count](uint32_t begin, uint32_t end) { count += end - begin; };
+	regionSearchRecursive(m_Nodes.data(), m_AABB, BoxRegion<Dim, Coord>{ box }, emit);
+	return count;
+}
+
+template <uint32_t Dim, typename Coord>
+template <typename Region, typename Emit>
+void KdTree<Dim, Coord>::regionSearchRecursive(const Node* node, const AABB& bounds, const Region& region, Emit& emit) const
+{
+	if (region.disjoint(bounds))
+		return;
+
+	if (region.contains(bounds))
+	{
+		emitSubtree(node, emit);
+		return;
+	}
+
+	if (node->isLeaf())
+	{
+		for (uint32_t i = node->begin; i < node->begin + node->count(); i++)
+		{
+			Coord coords[Dim];
+			ForEachAxis<Dim>::run([&](uint32_t j) { coords[j] = m_Coords[j][i]; });
+			if (region.contains(coords))
+				emit(i, i + 1);
 		}
 		return;
 	}
 
-	int32_t pvalue = p[node->axis];
+	// Points left of the plane are strictly below the split value, the others at or above it.
+	uint32_t axis = node->axis();
+	AABB leftBounds = bounds;
+	leftBounds.max[axis] = CoordTraits<Coord>::below(node->value);
+	AABB rightBounds = bounds;
+	rightBounds.min[axis] = node->value;
+
+	regionSearchRecursive(node->left(), leftBounds, region, emit);
+	regionSearchRecursive(node->right(), rightBounds, region, emit);
+}
 
-	// Search left first.
-	if (pvalue < node->value)
+template <uint32_t Dim, typename Coord>
+template <typename Emit>
+void KdTree<Dim, Coord>::emitSubtree(const Node* node, Emit& emit) const
+{
+	// Without spare positions, the subtree's points are all in a single range.
+	if (m_PointCount == size())
 	{
-		// Only keep searching if the circle with radius dist touches the splitting plane.
-		if (pvalue - dist < node->value)
-			nearestNeighborRecursive(node->left, p, nearest, dist);
-		if (pvalue + dist >= node->value)
-			nearestNeighborRecursive(node->right, p, nearest, dist);
+		uint32_t begin, end;
+		subtreeRange(node, begin, end);
+		emit(begin, end);
 	}
-	// Serach right first.
+	else if (node->isLeaf())
+		emit(node->begin, node->begin + node->count());
 	else
 	{
-		// Only keep searching if the circle with radius dist touches the splitting plane.
-		if (pvalue + dist >= node->value)
-			nearestNeighborRecursive(node->right, p, nearest, dist);
-		if (pvalue - dist < node->value)
-			nearestNeighborRecursive(node->left, p, nearest, dist);
+		emitSubtree(node->left(), emit);
+		emitSubtree(node->right(), emit);
 	}
 }
 
-void KdTree::freeNodes(KdTreeNode* node)
+template <uint32_t Dim, typename Coord>
+void KdTree<Dim, Coord>::subtreeRange(const Node* node, uint32_t& begin, uint32_t& end)
 {
-	if (node == nullptr || node->isLeaf())
-		return;
+	const Node* first = node;
+	while (!first->isLeaf())
+		first = first->left();
+
+	const Node* last = node;
+	while (!last->isLeaf())
+		last = last->right();
+
+	begin = first->begin;
+	end = last->begin + last->count();
+}
+
+template <uint32_t Dim, typename Coord>
+bool KdTree<Dim, Coord>::isSamePoint(uint32_t index, const Point& p) const
+{
+	if (!isAt(index, p.m_coords))
+		return false;
+
+	size_t length;
+	const char* chars = name(m_Ids[index], length);
+	return length == p.m_name.size() && std::memcmp(chars, p.m_name.data(), length) == 0;
+}
+
+template <uint32_t Dim, typename Coord>
+bool KdTree<Dim, Coord>::isQuery(uint32_t index, const Point& p, uint32_t self) const
+{
+	return self != InvalidIndex ? index == self : isSamePoint(index, p);
+}
+
+template <uint32_t Dim, typename Coord>
+template <typename ScanLeaf, typename Bound>
+void KdTree<Dim, Coord>::nearestFirstSearch(const Point& p, double pruneScale, bool reachTies, ScanLeaf& scanLeaf, Bound& bound) const
+{
+	// Arya and Mount's incremental distance: offsetSq holds, per axis, the squared distance from p to the region of
+	// the node being visited along that axis, and distSq their sum, the squared distance from p to the region.
+	// Going to a far child only changes the offset along the split axis, so its distance follows in constant time.
+	typedef CoordTraits<Coord> Traits;
+	struct StackEntry
+	{
+		const Node* node;
+		Distance distSq;
+		Distance offsetSq[Dim];
+	};
 
-	freeNodes(node->left);
-	freeNodes(node->right);
+	// At most one entry per level is pending at any time.
+	StackEntry localStack[TraversalStackCapacity];
+	std::vector<StackEntry> deepStack;
+	StackEntry* stack = localStack;
+	if (m_Depth > TraversalStackCapacity)
+	{
+		deepStack.resize(m_Depth);
+		stack = deepStack.data();
+	}
+	uint32_t top = 0;
+
+	// The root's region is the points' AABB, which queries far from the point set already start away from.
+	StackEntry current;
+	current.node = m_Nodes.data();
+	current.distSq = 0;
+	for (uint32_t axis = 0; axis < Dim; axis++)
+	{
+		Coord nearest = std::min(std::max(p[axis], m_AABB.min[axis]), m_AABB.max[axis]);
+		current.offsetSq[axis] = Traits::squaredDifference(p[axis], nearest);
+		current.distSq = Traits::add(current.distSq, current.offsetSq[axis]);
+	}
+
+	for (;;)
+	{
+		// Descend to the leaf on the query's side, leaving the other children for later.
+		const Node* node = current.node;
+		while (!node->isLeaf())
+		{
+			uint32_t axis = node->axis();
+			Coord pvalue = p[axis];
+			Distance planeDistSq = Traits::squaredDifference(pvalue, node->value);
+			const Node* farNode = node->right();
+			if (pvalue < node->value)
+				node = node->left();
+			else
+			{
+				farNode = node->left();
+				node = node->right();
+			}
+
+			// The far child's region lies beyond the splitting plane, which is at least as far from p as the current
+			// region is along the split axis. Children already out of reach are never pushed.
+			// Offsets are summed in axis order, as point distances are, so that rounding never makes a region look
+			// farther than the points it holds.
+			Distance farDistSq = 0;
+			for (uint32_t i = 0; i < Dim; i++)
+				farDistSq = Traits::add(farDistSq, i == axis ? planeDistSq : current.offsetSq[i]);
+			if (withinReach(farDistSq, bound(), pruneScale, reachTies))
+			{
+				StackEntry& far = stack[top++];
+				far.node = farNode;
+				far.distSq = farDistSq;
+				for (uint32_t i = 0; i < Dim; i++)
+					far.offsetSq[i] = current.offsetSq[i];
+				far.offsetSq[axis] = planeDistSq;
+			}
+		}
+
+		scanLeaf(node);
+
+		// Resume with the deepest pending child whose region is still within reach.
+		for (;;)
+		{
+			if (top == 0)
+				return;
+
+			current = stack[--top];
+			if (withinReach(current.distSq, bound(), pruneScale, reachTies))
+				break;
+		}
+	}
+}
+
+template <uint32_t Dim, typename Coord>
+void KdTree<Dim, Coord>::nearestNeighborSearch(const Point& p, uint32_t self, uint32_t& nearest, Distance& distSq, double pruneScale) const
+{
+	const Coord* q = p.m_coords;
+
+	auto scanLeaf = [&](const Node* leaf)
+	{
+		uint32_t begin = leaf->begin;
+		uint32_t end = begin + leaf->count();
+
+		// The scan leaves out points at the query's coordinates, as one of them is usually the query itself.
+		// Any other point there is at distance zero and beats everything, but one at a lower position.
+		if (scanPoints(begin, end, q, distSq, nearest) && (distSq > 0 || begin < nearest))
+		{
+			for (uint32_t i = begin; i < end && (distSq > 0 || i < nearest); i++)
+			{
+				if (isAt(i, q) && !isQuery(i, p, self))
+				{
+					distSq = 0;
+					nearest = i;
+					break;
+				}
+			}
+		}
+	};
+	// A region is only searched if the circle with radius dist / (1 + epsilon) reaches into it. Exact searches also
+	// search the regions it touches, so that ties go to the lowest position whatever order the leaves come in.
+	auto bound = [&distSq]() { return distSq; };
+
+	nearestFirstSearch(p, pruneScale, true, scanLeaf, bound);
+}
 
-	delete node->left;
-	delete node->right;
-}
\ No newline at end of file
+template class KdTree<2, int32_t>;
+template class KdTree<2, float>;
+template class KdTree<3, float>;
\ No newline at end of file
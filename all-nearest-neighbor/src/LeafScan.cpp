@@ -0,0 +1,196 @@
+#include "../include/LeafScan.h"
+#include "../include/KdTree.h"
+
+#ifdef LEAFSCAN_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+// GCC and Clang only emit AVX2 instructions in functions explicitly compiled for it.
+// MSVC accepts the intrinsics anywhere.
+#if defined(__GNUC__)
+#define LEAFSCAN_TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define LEAFSCAN_TARGET_AVX2
+#endif
+
+
+// Shared with the AVX2 kernel for the points left over, where it has to be inlined: an out of line call would leave
+// the upper halves of the AVX registers dirty, which slows down SSE code all over the search.
+static inline bool scanRange(const int32_t* xs, const int32_t* ys, uint32_t begin, uint32_t end, int32_t qx, int32_t qy, uint64_t& bestDistSq, uint32_t& bestIndex)
+{
+	bool coincident = false;
+
+	for (uint32_t i = begin; i < end; i++)
+	{
+		uint64_t d = squaredDistance(xs[i], ys[i], qx, qy);
+		if (d == 0)
+		{
+			coincident = true;
+			continue;
+		}
+
+		// Equally close points only win with a lower index. Saturated distances never tie, as they stand for any
+		// distance too large to represent.
+		if (d < bestDistSq)
+		{
+			bestDistSq = d;
+			bestIndex = i;
+		}
+		else if (d == bestDistSq && i < bestIndex && d != UINT64_MAX)
+			bestIndex = i;
+	}
+
+	return coincident;
+}
+
+bool leafScanScalar(const int32_t* xs, const int32_t* ys, uint32_t begin, uint32_t end, int32_t qx, int32_t qy, uint64_t& bestDistSq, uint32_t& bestIndex)
+{
+	return scanRange(xs, ys, begin, end, qx, qy, bestDistSq, bestIndex);
+}
+
+#ifdef LEAFSCAN_X86
+
+// Squared distances from four points to the query, in 64-bit lanes.
+// Points at the query's coordinates are set to UINT64_MAX so that they never win, and flagged in coincident.
+LEAFSCAN_TARGET_AVX2 static inline __m256i squaredDistances4(const int32_t* xs, const int32_t* ys, __m256i qx, __m256i qy, __m256i& coincident)
+{
+	const __m256i zero = _mm256_setzero_si256();
+
+	// Differences of int32 values need 33 bits, so work on sign extended 64-bit lanes.
+	__m256i dx = _mm256_sub_epi64(_mm256_cvtepi32_epi64(_mm_loadu_si128((const __m128i*)xs)), qx);
+	__m256i dy = _mm256_sub_epi64(_mm256_cvtepi32_epi64(_mm_loadu_si128((const __m128i*)ys)), qy);
+
+	// Absolute values fit in 32 bits, which is all _mm256_mul_epu32 reads.
+	__m256i sx = _mm256_cmpgt_epi64(zero, dx);
+	__m256i sy = _mm256_cmpgt_epi64(zero, dy);
+	dx = _mm256_sub_epi64(_mm256_xor_si256(dx, sx), sx);
+	dy = _mm256_sub_epi64(_mm256_xor_si256(dy, sy), sy);
+
+	__m256i dx2 = _mm256_mul_epu32(dx, dx);
+	__m256i d = _mm256_add_epi64(dx2, _mm256_mul_epu32(dy, dy));
+
+	// Saturate on overflow, as squaredDistance does. The sum wrapped if it is (unsigned) below dx2.
+	const __m256i signBit = _mm256_set1_epi64x(INT64_MIN);
+	__m256i overflow = _mm256_cmpgt_epi64(_mm256_xor_si256(dx2, signBit), _mm256_xor_si256(d, signBit));
+
+	__m256i same = _mm256_cmpeq_epi64(d, zero);
+	coincident = _mm256_or_si256(coincident, same);
+
+	return _mm256_or_si256(d, _mm256_or_si256(overflow, same));
+}
+
+LEAFSCAN_TARGET_AVX2 bool leafScanAvx2(const int32_t* xs, const int32_t* ys, uint32_t begin, uint32_t end, int32_t qx, int32_t qy, uint64_t& bestDistSq, uint32_t& bestIndex)
+{
+	uint32_t i = begin;
+	bool coincident = false;
+
+	if (end - begin >= 8)
+	{
+		const __m256i qxs = _mm256_set1_epi64x(qx);
+		const __m256i qys = _mm256_set1_epi64x(qy);
+		// AVX2 only compares signed 64-bit integers. Flipping the sign bit maps unsigned order onto signed order,
+		// so the per-lane minima are kept in that form.
+		const __m256i signBit = _mm256_set1_epi64x(INT64_MIN);
+		const __m256i step = _mm256_set1_epi64x(8);
+
+		// Eight lanes, as two halves of four.
+		__m256i bestLo = _mm256_set1_epi64x(INT64_MAX);
+		__m256i bestHi = bestLo;
+		__m256i bestIdxLo = _mm256_setzero_si256();
+		__m256i bestIdxHi = bestIdxLo;
+		__m256i idxLo = _mm256_setr_epi64x(i, i + 1, i + 2, i + 3);
+		__m256i idxHi = _mm256_setr_epi64x(i + 4, i + 5, i + 6, i + 7);
+		__m256i same = _mm256_setzero_si256();
+
+		for (; i + 8 <= end; i += 8)
+		{
+			__m256i dLo = _mm256_xor_si256(squaredDistances4(xs + i, ys + i, qxs, qys, same), signBit);
+			__m256i dHi = _mm256_xor_si256(squaredDistances4(xs + i + 4, ys + i + 4, qxs, qys, same), signBit);
+
+			// Strictly closer only, so each lane keeps its first minimum.
+			__m256i closerLo = _mm256_cmpgt_epi64(bestLo, dLo);
+			__m256i closerHi = _mm256_cmpgt_epi64(bestHi, dHi);
+			bestLo = _mm256_blendv_epi8(bestLo, dLo, closerLo);
+			bestHi = _mm256_blendv_epi8(bestHi, dHi, closerHi);
+			bestIdxLo = _mm256_blendv_epi8(bestIdxLo, idxLo, closerLo);
+			bestIdxHi = _mm256_blendv_epi8(bestIdxHi, idxHi, closerHi);
+
+			idxLo = _mm256_add_epi64(idxLo, step);
+			idxHi = _mm256_add_epi64(idxHi, step);
+		}
+
+		coincident = !_mm256_testz_si256(same, same);
+
+		alignas(32) uint64_t dists[8];
+		alignas(32) uint64_t indices[8];
+		_mm256_store_si256((__m256i*)dists, _mm256_xor_si256(bestLo, signBit));
+		_mm256_store_si256((__m256i*)(dists + 4), _mm256_xor_si256(bestHi, signBit));
+		_mm256_store_si256((__m256i*)indices, bestIdxLo);
+		_mm256_store_si256((__m256i*)(indices + 4), bestIdxHi);
+
+		// Reduce the lanes, breaking ties by index.
+		uint64_t leafDistSq = dists[0];
+		uint64_t leafIndex = indices[0];
+		for (int lane = 1; lane < 8; lane++)
+		{
+			if (dists[lane] < leafDistSq || (dists[lane] == leafDistSq && indices[lane] < leafIndex))
+			{
+				leafDistSq = dists[lane];
+				leafIndex = indices[lane];
+			}
+		}
+
+		// Lanes left at UINT64_MAX may hold points at the query, which must not tie.
+		if (leafDistSq < bestDistSq || (leafDistSq == bestDistSq && leafIndex < bestIndex && leafDistSq != UINT64_MAX))
+		{
+			bestDistSq = leafDistSq;
+			bestIndex = (uint32_t)leafIndex;
+		}
+	}
+
+	// Remaining points.
+	if (scanRange(xs, ys, i, end, qx, qy, bestDistSq, bestIndex))
+		coincident = true;
+
+	return coincident;
+}
+
+#endif // LEAFSCAN_X86
+
+bool cpuSupportsAvx2()
+{
+#if defined(LEAFSCAN_X86) && defined(_MSC_VER)
+	int info[4];
+	__cpuid(info, 0);
+	if (info[0] < 7)
+		return false;
+
+	// The OS must also save the AVX registers on context switches.
+	__cpuid(info, 1);
+	bool osxsave = (info[2] & (1 << 27)) != 0;
+	bool avx = (info[2] & (1 << 28)) != 0;
+	if (!osxsave || !avx || (_xgetbv(0) & 6) != 6)
+		return false;
+
+	__cpuidex(info, 7, 0);
+	return (info[1] & (1 << 5)) != 0;
+#elif defined(LEAFSCAN_X86) && defined(__GNUC__)
+	return __builtin_cpu_supports("avx2");
+#else
+	return false;
+#endif
+}
+
+LeafScanFunction selectLeafScan()
+{
+	// The CPU is only queried once, on the first call.
+#ifdef LEAFSCAN_X86
+	static const LeafScanFunction kernel = cpuSupportsAvx2() ? leafScanAvx2 : leafScanScalar;
+#else
+	static const LeafScanFunction kernel = leafScanScalar;
+#endif
+	return kernel;
+}
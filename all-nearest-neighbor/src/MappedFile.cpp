@@ -0,0 +1,89 @@
+#include "../include/MappedFile.h"
+
+#include <stdexcept>
+
+#ifdef _WIN32
+#define NOMINMAX
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+
+#ifdef _WIN32
+MappedFile::MappedFile(const std::string& path)
+{
+	HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (file == INVALID_HANDLE_VALUE)
+		throw std::logic_error("Cannot open " + path + ".");
+
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(file, &size))
+	{
+		CloseHandle(file);
+		throw std::logic_error("Cannot read the size of " + path + ".");
+	}
+	m_Size = (size_t)size.QuadPart;
+
+	// Empty files cannot be mapped, and need not be.
+	if (m_Size > 0)
+	{
+		// The mapping keeps the file open.
+		m_Mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+		if (m_Mapping)
+			m_Data = (const char*)MapViewOfFile(m_Mapping, FILE_MAP_READ, 0, 0, 0);
+	}
+	CloseHandle(file);
+
+	if (m_Size > 0 && !m_Data)
+	{
+		if (m_Mapping)
+			CloseHandle(m_Mapping);
+		throw std::logic_error("Cannot map " + path + ".");
+	}
+}
+
+MappedFile::~MappedFile()
+{
+	if (m_Data)
+		UnmapViewOfFile(m_Data);
+	if (m_Mapping)
+		CloseHandle(m_Mapping);
+}
+#else
+MappedFile::MappedFile(const std::string& path)
+{
+	int file = open(path.c_str(), O_RDONLY);
+	if (file < 0)
+		throw std::logic_error("Cannot open " + path + ".");
+
+	struct stat status;
+	if (fstat(file, &status) != 0)
+	{
+		close(file);
+		throw std::logic_error("Cannot read the size of " + path + ".");
+	}
+	m_Size = (size_t)status.st_size;
+
+	// Empty files cannot be mapped, and need not be. The mapping keeps the file open.
+	if (m_Size > 0)
+	{
+		void* data = mmap(nullptr, m_Size, PROT_READ, MAP_SHARED, file, 0);
+		m_Data = data == MAP_FAILED ? nullptr : (const char*)data;
+	}
+	close(file);
+
+	if (m_Size > 0 && !m_Data)
+		throw std::logic_error("Cannot map " + path + ".");
+}
+
+MappedFile::~MappedFile()
+{
+	if (m_Data)
+		munmap((void*)m_Data, m_Size);
+}
+#endif
\ No newline at end of file
@@ -1,18 +1,42 @@
 #include "../include/Point.h"
+#include <limits>
+#include <stdexcept>
 
-Point::Point(int32_t x, int32_t y)
+namespace
 {
-	m_x = x;
-	m_y = y;
+	// Parses a coordinate, throwing std::out_of_range if it does not fit Coord rather than wrapping it around.
+	template <typename Coord>
+	Coord parseCoord(const std::string& val)
+	{
+		if (std::is_integral<Coord>::value)
+		{
+			long long value = std::stoll(val);
+			if (value < (long long)std::numeric_limits<Coord>::min() || value > (long long)std::numeric_limits<Coord>::max())
+				throw std::out_of_range("Coordinate out of range: " + val);
+			return static_cast<Coord>(value);
+		}
+
+		double value = std::stod(val);
+		if (value < -(double)std::numeric_limits<Coord>::max() || value > (double)std::numeric_limits<Coord>::max())
+			throw std::out_of_range("Coordinate out of range: " + val);
+		return static_cast<Coord>(value);
+	}
 }
 
-bool Point::operator==(const Point& other) const
+template <uint32_t Dim, typename Coord>
+bool BasicPoint<Dim, Coord>::operator==(const BasicPoint& other) const
 {
-	return m_name == other.m_name && m_x == other.m_x && m_y == other.m_y;
+	for (uint32_t i = 0; i < Dim; i++)
+	{
+		if (m_coords[i] != other.m_coords[i])
+			return false;
+	}
+	return m_name == other.m_name;
 }
 
 
-std::istream& operator >> (std::istream& stream, Point& point)
+template <uint32_t Dim, typename Coord>
+std::istream& operator >> (std::istream& stream, BasicPoint<Dim, Coord>& point)
 {
 	stream >> point.m_name;
 
@@ -22,15 +46,15 @@ std::istream& operator >> (std::istream& stream, Point& point)
 
 		//bracket
 		stream >> val;
-		//x
-		stream >> val;
-		point.m_x = std::stoi(val);
-
-		//comma
-		stream >> val;
-		//y
-		stream >> val;
-		point.m_y = std::stoi(val);
+		for (uint32_t i = 0; i < Dim; i++)
+		{
+			//comma
+			if (i > 0)
+				stream >> val;
+			//coordinate
+			stream >> val;
+			point.m_coords[i] = parseCoord<Coord>(val);
+		}
 
 		//bracket
 		stream >> val;
@@ -39,9 +63,22 @@ std::istream& operator >> (std::istream& stream, Point& point)
 	return stream;
 }
 
-std::ostream& operator<<(std::ostream& stream, const Point& point)
+template <uint32_t Dim, typename Coord>
+std::ostream& operator<<(std::ostream& stream, const BasicPoint<Dim, Coord>& point)
 {
-	stream << point.m_name << " ( " << point.m_x << " , " << point.m_y << " ) ";
+	stream << point.m_name << " (";
+	for (uint32_t i = 0; i < Dim; i++)
+		stream << (i > 0 ? " , " : " ") << point.m_coords[i];
+	stream << " ) ";
 
 	return stream;
-}
\ No newline at end of file
+}
+
+#define INSTANTIATE_POINT(Dim, Coord) \
+	template struct BasicPoint<Dim, Coord>; \
+	template std::istream& operator >> (std::istream& stream, BasicPoint<Dim, Coord>& point); \
+	template std::ostream& operator << (std::ostream& stream, const BasicPoint<Dim, Coord>& point);
+
+INSTANTIATE_POINT(2, int32_t)
+INSTANTIATE_POINT(2, float)
+INSTANTIATE_POINT(3, float)
\ No newline at end of file
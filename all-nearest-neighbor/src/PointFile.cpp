@@ -0,0 +1,347 @@
+#include "../include/PointFile.h"
+#include "../include/MappedFile.h"
+#include "../include/TaskPool.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <locale>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+
+namespace
+{
+	// Files are cut into chunks of about this size: large enough for a task to be worth its scheduling, small
+	// enough for many of them to share the threads evenly.
+	const size_t ChunkSize = 1 << 22;
+
+	// Whitespace within a line.
+	inline bool isBlank(char c)
+	{
+		return c == ' ' || c == '\t' || c == '\r' || c == '\v' || c == '\f';
+	}
+
+	inline void skipBlanks(const char*& text, const char* end)
+	{
+		while (text < end && isBlank(*text))
+			text++;
+	}
+
+	// Parses the coordinate at text, and moves text past it. Returns false if there is none or it does not fit.
+	inline bool parseCoord(const char*& text, const char* end, int32_t& value)
+	{
+		const char* p = text;
+		bool negative = false;
+		if (p < end && (*p == '-' || *p == '+'))
+			negative = *p++ == '-';
+		if (p == end || *p < '0' || *p > '9')
+			return false;
+
+		const uint64_t limit = negative ? (uint64_t)INT32_MAX + 1 : (uint64_t)INT32_MAX;
+		uint64_t magnitude = 0;
+		for (; p < end && *p >= '0' && *p <= '9'; p++)
+		{
+			magnitude = magnitude * 10 + (uint64_t)(*p - '0');
+			if (magnitude > limit)
+				return false;
+		}
+
+		value = (int32_t)(negative ? -(int64_t)magnitude : (int64_t)magnitude);
+		text = p;
+		return true;
+	}
+
+	inline bool isDigit(const char* p, const char* end)
+	{
+		return p < end && *p >= '0' && *p <= '9';
+	}
+
+	// Parses a decimal number in the classic format, whatever the C locale is, rounded to the nearest float. Most are
+	// converted with double arithmetic, the others by a stream in the classic locale. Returns false if there is none,
+	// or it is beyond the largest float once rounded.
+	inline bool parseCoord(const char*& text, const char* end, float& value)
+	{
+		const char* p = text;
+		bool negative = false;
+		if (p < end && (*p == '-' || *p == '+'))
+			negative = *p++ == '-';
+
+		// The significant digits, and the power of ten they are scaled by.
+		uint64_t mantissa = 0;
+		int digitCount = 0;
+		int64_t exponent = 0;
+		bool anyDigit = false;
+		for (; isDigit(p, end); p++)
+		{
+			anyDigit = true;
+			if (digitCount < 19)
+			{
+				mantissa = mantissa * 10 + (uint64_t)(*p - '0');
+				digitCount += mantissa != 0 ? 1 : 0;
+			}
+			else
+				exponent++;
+		}
+		if (p < end && *p == '.')
+		{
+			for (p++; isDigit(p, end); p++)
+			{
+				anyDigit = true;
+				if (digitCount < 19)
+				{
+					mantissa = mantissa * 10 + (uint64_t)(*p - '0');
+					digitCount += mantissa != 0 ? 1 : 0;
+					exponent--;
+				}
+			}
+		}
+		if (!anyDigit)
+			return false;
+
+		if (p < end && (*p == 'e' || *p == 'E'))
+		{
+			p++;
+			bool negativeExponent = false;
+			if (p < end && (*p == '-' || *p == '+'))
+				negativeExponent = *p++ == '-';
+			if (!isDigit(p, end))
+				return false;
+
+			// Anything this far out is zero or out of range anyway.
+			int64_t power = 0;
+			for (; isDigit(p, end); p++)
+				power = std::min<int64_t>(power * 10 + (*p - '0'), 100000);
+			exponent += negativeExponent ? -power : power;
+		}
+
+		// Scaled in double arithmetic, the number is off by a few units in the last place at most: it is rounded up to
+		// three times, and digits beyond the 19th are dropped. Rounding it to a float then gives the right result, unless
+		// it lies that close to halfway between two floats. The stream settles those.
+		static const double powersOfTen[] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22 };
+		// Beyond the halfway point between the largest float and the next power of two, rounding gives infinity.
+		const double limit = (double)std::numeric_limits<float>::max() + std::ldexp(1.0, std::numeric_limits<float>::max_exponent - std::numeric_limits<float>::digits - 1);
+		double d = 0.0;
+		bool converted = mantissa == 0;
+		if (!converted && exponent >= -44 && exponent <= 44)
+		{
+			d = (double)mantissa;
+			int64_t power = exponent;
+			if (power < -22)
+			{
+				d /= powersOfTen[22];
+				power += 22;
+			}
+			else if (power > 22)
+			{
+				d *= powersOfTen[22];
+				power -= 22;
+			}
+			d = power < 0 ? d / powersOfTen[-power] : d * powersOfTen[power];
+
+			float f = (float)std::min(d, (double)std::numeric_limits<float>::max());
+			float other = std::nextafter(f, d > f ? std::numeric_limits<float>::infinity() : 0.0f);
+			double halfway = ((double)f + (double)other) * 0.5;
+			double margin = d * std::ldexp(1.0, -50);
+			converted = std::fabs(d - halfway) > margin && std::fabs(d - limit) > margin;
+		}
+
+		if (converted)
+		{
+			if (d >= limit)
+				return false;
+			value = (float)(negative ? -d : d);
+		}
+		else
+		{
+			// Read as a float directly, as rounding through a double could land halfway between two floats.
+			std::istringstream stream(std::string(text, p));
+			stream.imbue(std::locale::classic());
+			float f;
+			stream >> f;
+			// The number is well formed, so the stream only fails if it is beyond the range of floats. Those too
+			// small are zero.
+			if (stream.fail())
+			{
+				if (exponent + digitCount > 0)
+					return false;
+				f = negative ? -0.0f : 0.0f;
+			}
+			value = f;
+		}
+
+		text = p;
+		return true;
+	}
+
+	// Parses the point at text, up to the end of its line, and moves text there. Returns what is wrong with the line,
+	// or nullptr if it is a point.
+	template <uint32_t Dim, typename Coord>
+	const char* parsePoint(const char*& text, const char* end, Coord* coords, const char*& name, const char*& nameEnd)
+	{
+		const char* p = text;
+		name = p;
+		while (p < end && !isBlank(*p) && *p != '\n' && *p != '(')
+			p++;
+		nameEnd = p;
+		if (name == nameEnd)
+			return "expected a name";
+
+		skipBlanks(p, end);
+		if (p == end || *p++ != '(')
+			return "expected '('";
+		for (uint32_t axis = 0; axis < Dim; axis++)
+		{
+			skipBlanks(p, end);
+			if (axis > 0)
+			{
+				if (p == end || *p++ != ',')
+					return "expected ','";
+				skipBlanks(p, end);
+			}
+			if (!parseCoord(p, end, coords[axis]))
+				return "expected a coordinate within range";
+		}
+		skipBlanks(p, end);
+		if (p == end || *p++ != ')')
+			return "expected ')'";
+
+		skipBlanks(p, end);
+		if (p < end && *p != '\n')
+			return "unexpected text after the point";
+
+		text = p;
+		return nullptr;
+	}
+}
+
+const char* pointChunkEnd(const char* begin, const char* end, size_t size)
+{
+	if ((size_t)(end - begin) <= size)
+		return end;
+
+	const char* lineBreak = (const char*)std::memchr(begin + size, '\n', (size_t)(end - begin - size));
+	return lineBreak ? lineBreak + 1 : end;
+}
+
+template <uint32_t Dim, typename Coord>
+uint64_t parsePoints(const char* begin, const char* end, BasicPointArrays<Dim, Coord>& points, const char*& error)
+{
+	if (points.nameOffsets.empty())
+		points.nameOffsets.push_back(0);
+
+	uint64_t lineCount = 0;
+	error = nullptr;
+	const char* p = begin;
+	while (p < end)
+	{
+		skipBlanks(p, end);
+		if (p == end)
+			break;
+		if (*p == '\n')
+		{
+			lineCount++;
+			p++;
+			continue;
+		}
+
+		Coord coords[Dim];
+		const char* name;
+		const char* nameEnd;
+		error = parsePoint<Dim, Coord>(p, end, coords, name, nameEnd);
+		if (error)
+			break;
+
+		for (uint32_t axis = 0; axis < Dim; axis++)
+			points.coords[axis].push_back(coords[axis]);
+		points.names.insert(points.names.end(), name, nameEnd);
+		points.nameOffsets.push_back(points.names.size());
+	}
+	return lineCount;
+}
+
+template <uint32_t Dim, typename Coord>
+void readPointFile(const std::string& path, BasicPointArrays<Dim, Coord>& points)
+{
+	// The points of a chunk of the file.
+	struct Chunk
+	{
+		const char* begin;
+		const char* end;
+		BasicPointArrays<Dim, Coord> points;
+		uint64_t lineCount;
+		const char* error;
+	};
+
+	MappedFile file(path);
+	const char* end = file.data() + file.size();
+
+	std::vector<Chunk> chunks;
+	for (const char* begin = file.data(); begin < end;)
+	{
+		const char* chunkEnd = pointChunkEnd(begin, end, ChunkSize);
+		chunks.emplace_back();
+		chunks.back().begin = begin;
+		chunks.back().end = chunkEnd;
+		begin = chunkEnd;
+	}
+
+	TaskPool& pool = TaskPool::global();
+	pool.parallelFor((uint32_t)chunks.size(), [&](uint32_t i)
+	{
+		Chunk& chunk = chunks[i];
+		chunk.lineCount = parsePoints(chunk.begin, chunk.end, chunk.points, chunk.error);
+	});
+
+	// Report the first faulty line. The chunks before it have been parsed through, so their line counts are complete.
+	uint64_t lineCount = 0;
+	for (const Chunk& chunk : chunks)
+	{
+		if (chunk.error)
+			throw std::logic_error(path + ":" + std::to_string(lineCount + chunk.lineCount + 1) + ": " + chunk.error + ".");
+		lineCount += chunk.lineCount;
+	}
+
+	// Where the points and names of each chunk go.
+	std::vector<uint64_t> pointBegins(chunks.size() + 1, 0);
+	std::vector<uint64_t> nameBegins(chunks.size() + 1, 0);
+	for (size_t i = 0; i < chunks.size(); i++)
+	{
+		pointBegins[i + 1] = pointBegins[i] + chunks[i].points.size();
+		nameBegins[i + 1] = nameBegins[i] + chunks[i].points.names.size();
+	}
+	const uint64_t pointCount = pointBegins.back();
+	if (pointCount >= UINT32_MAX)
+		throw std::logic_error(path + " holds too many points.");
+
+	for (uint32_t axis = 0; axis < Dim; axis++)
+		points.coords[axis].resize((size_t)pointCount);
+	points.names.resize((size_t)nameBegins.back());
+	points.nameOffsets.resize((size_t)pointCount + 1);
+	points.nameOffsets[(size_t)pointCount] = nameBegins.back();
+
+	// Each chunk is freed as soon as it has been copied.
+	pool.parallelFor((uint32_t)chunks.size(), [&](uint32_t i)
+	{
+		BasicPointArrays<Dim, Coord>& chunk = chunks[i].points;
+		const size_t pointBegin = (size_t)pointBegins[i];
+		for (uint32_t axis = 0; axis < Dim; axis++)
+			std::copy(chunk.coords[axis].begin(), chunk.coords[axis].end(), points.coords[axis].begin() + pointBegin);
+		std::copy(chunk.names.begin(), chunk.names.end(), points.names.begin() + (size_t)nameBegins[i]);
+		for (uint32_t k = 0; k < chunk.size(); k++)
+			points.nameOffsets[pointBegin + k] = nameBegins[i] + chunk.nameOffsets[k];
+
+		chunk = BasicPointArrays<Dim, Coord>();
+	});
+}
+
+#define INSTANTIATE_POINT_FILE(Dim, Coord) \
+	template uint64_t parsePoints(const char* begin, const char* end, BasicPointArrays<Dim, Coord>& points, const char*& error); \
+	template void readPointFile(const std::string& path, BasicPointArrays<Dim, Coord>& points);
+
+INSTANTIATE_POINT_FILE(2, int32_t)
+INSTANTIATE_POINT_FILE(2, float)
+INSTANTIATE_POINT_FILE(3, float)
\ No newline at end of file
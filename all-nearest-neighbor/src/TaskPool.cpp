@@ -0,0 +1,165 @@
+#include "../include/TaskPool.h"
+
+#include <algorithm>
+
+
+// The pool and queue the current thread works for, if it is a worker.
+static thread_local const TaskPool* t_Pool = nullptr;
+static thread_local unsigned t_Queue = 0;
+
+TaskPool::TaskPool(unsigned workerCount)
+	: m_Queued(0)
+{
+	for (unsigned i = 0; i < workerCount + 1; i++)
+		m_Queues.emplace_back(new Queue());
+
+	m_Workers.reserve(workerCount);
+	for (unsigned i = 0; i < workerCount; i++)
+		m_Workers.emplace_back(&TaskPool::workerLoop, this, i);
+}
+
+TaskPool::~TaskPool()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_SleepMutex);
+		m_Stop = true;
+	}
+	m_WakeUp.notify_all();
+
+	for (size_t i = 0; i < m_Workers.size(); i++)
+		m_Workers[i].join();
+}
+
+TaskPool& TaskPool::global()
+{
+	static TaskPool pool(std::max(1u, std::thread::hardware_concurrency()) - 1);
+	return pool;
+}
+
+unsigned TaskPool::ownQueue() const
+{
+	return t_Pool == this ? t_Queue : (unsigned)m_Queues.size() - 1;
+}
+
+void TaskPool::run(Group& group, std::function<void()> task)
+{
+	group.pending++;
+
+	// Counted before it can be taken, so that m_Queued never drops below zero.
+	Queue& queue = *m_Queues[ownQueue()];
+	{
+		std::lock_guard<std::mutex> lock(queue.mutex);
+		m_Queued++;
+		queue.tasks.push_back(Task{ std::move(task), &group });
+	}
+
+	// Taking the lock makes sure a worker about to sleep either sees the new task or gets the notification.
+	{
+		std::lock_guard<std::mutex> lock(m_SleepMutex);
+	}
+	m_WakeUp.notify_one();
+}
+
+void TaskPool::wait(Group& group)
+{
+	unsigned queue = ownQueue();
+	while (group.pending > 0)
+	{
+		if (tryRunTask(queue))
+			continue;
+
+		// The group's last tasks are running on other threads.
+		std::unique_lock<std::mutex> lock(m_SleepMutex);
+		m_WakeUp.wait(lock, [this, &group]() { return group.pending == 0 || m_Queued > 0; });
+	}
+
+	std::exception_ptr error;
+	{
+		std::lock_guard<std::mutex> lock(group.errorMutex);
+		error.swap(group.error);
+	}
+	if (error)
+		std::rethrow_exception(error);
+}
+
+void TaskPool::parallelFor(uint32_t count, const std::function<void(uint32_t)>& fn)
+{
+	Group group;
+	for (uint32_t i = 0; i < count; i++)
+		run(group, [&fn, i]() { fn(i); });
+	wait(group);
+}
+
+bool TaskPool::tryRunTask(unsigned queue)
+{
+	Task task;
+	bool found = false;
+
+	// Own tasks are taken from the back, as they are the most likely to still be in cache.
+	{
+		Queue& own = *m_Queues[queue];
+		std::lock_guard<std::mutex> lock(own.mutex);
+		if (!own.tasks.empty())
+		{
+			task = std::move(own.tasks.back());
+			own.tasks.pop_back();
+			found = true;
+		}
+	}
+
+	// Steal from the front of the other queues, where the oldest and usually largest tasks are.
+	for (size_t i = 1; !found && i < m_Queues.size(); i++)
+	{
+		Queue& other = *m_Queues[(queue + i) % m_Queues.size()];
+		std::lock_guard<std::mutex> lock(other.mutex);
+		if (!other.tasks.empty())
+		{
+			task = std::move(other.tasks.front());
+			other.tasks.pop_front();
+			found = true;
+		}
+	}
+
+	if (!found)
+		return false;
+
+	m_Queued--;
+	try
+	{
+		task.fn();
+	}
+	catch (...)
+	{
+		std::lock_guard<std::mutex> lock(task.group->errorMutex);
+		if (!task.group->error)
+			task.group->error = std::current_exception();
+	}
+
+	// The group may be gone as soon as the count drops to zero, so it is not touched after that.
+	if (--task.group->pending == 0)
+	{
+		// Taking the lock makes sure a thread about to wait either sees the count or gets the notification.
+		{
+			std::lock_guard<std::mutex> lock(m_SleepMutex);
+		}
+		m_WakeUp.notify_all();
+	}
+	return true;
+}
+
+void TaskPool::workerLoop(unsigned index)
+{
+	t_Pool = this;
+	t_Queue = index;
+
+	for (;;)
+	{
+		if (tryRunTask(index))
+			continue;
+
+		std::unique_lock<std::mutex> lock(m_SleepMutex);
+		m_WakeUp.wait(lock, [this]() { return m_Stop || m_Queued > 0; });
+		if (m_Stop)
+			return;
+	}
+}
@@ -0,0 +1,528 @@
+// Batch all nearest neighbors: reads a point file, builds a KdTree over it and writes the nearest neighbors of every
+// point, as a pipeline whose stages overlap.
+//   parse: the file is mapped and cut into chunks at line breaks, parsed in parallel a few at a time.
+//   build: the parsed chunks are gathered into column-wise arrays as they come, then the tree is built on all cores,
+//          taking the arrays over. The upper levels of the tree are not split while the parsing goes on: every split
+//          is at the median of its points, which is only known once all of them are in, and splitting at a median
+//          estimated from the points parsed so far would give another tree than KdTree::build does, and so other
+//          neighbors wherever distances tie. Gathering the chunks is as far as the build overlaps the parsing.
+//   query: the tree is queried in chunks of positions, in parallel a few at a time, and the results formatted.
+//   write: the formatted chunks are written out while the next ones are queried.
+// Stages hand their output over through bounded queues, so a fast stage waits for a slow one instead of piling up
+// memory, and the wall time approaches that of the slowest stage rather than their sum.
+
+#include "../include/KdTree.h"
+#include "../include/MappedFile.h"
+#include "../include/PointFile.h"
+#include "../include/TaskPool.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <iostream>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+
+namespace
+{
+	typedef std::chrono::steady_clock Clock;
+
+	double secondsSince(Clock::time_point start)
+	{
+		return std::chrono::duration<double>(Clock::now() - start).count();
+	}
+
+	// Holds at most capacity items on their way from one stage to the next, for a single stage pushing and a single
+	// stage popping. Keeps track of how long each of them waited, which is not time spent working.
+	template <typename T>
+	class BoundedQueue
+	{
+	public:
+		explicit BoundedQueue(size_t capacity) : m_Capacity(capacity) {}
+
+		// Waits for room if the queue is full.
+		void push(T item)
+		{
+			std::unique_lock<std::mutex> lock(m_Mutex);
+			if (m_Items.size() >= m_Capacity)
+			{
+				Clock::time_point waitStart = Clock::now();
+				m_NotFull.wait(lock, [this]() { return m_Items.size() < m_Capacity; });
+				m_PushWaitSeconds += secondsSince(waitStart);
+			}
+			m_Items.push_back(std::move(item));
+			m_NotEmpty.notify_one();
+		}
+
+		// Tells the next stage that no more items will come.
+		void close()
+		{
+			std::lock_guard<std::mutex> lock(m_Mutex);
+			m_Closed = true;
+			m_NotEmpty.notify_all();
+		}
+
+		// Waits for the next item. Returns false once the queue has been closed and emptied.
+		bool pop(T& item)
+		{
+			std::unique_lock<std::mutex> lock(m_Mutex);
+			if (m_Items.empty() && !m_Closed)
+			{
+				Clock::time_point waitStart = Clock::now();
+				m_NotEmpty.wait(lock, [this]() { return !m_Items.empty() || m_Closed; });
+				m_PopWaitSeconds += secondsSince(waitStart);
+			}
+			if (m_Items.empty())
+				return false;
+
+			item = std::move(m_Items.front());
+			m_Items.pop_front();
+			m_NotFull.notify_one();
+			return true;
+		}
+
+		// The time push() spent waiting for room. Only to be read by the thread pushing.
+		double pushWaitSeconds() const { return m_PushWaitSeconds; }
+		// The time pop() spent waiting for items. Only to be read by the thread popping.
+		double popWaitSeconds() const { return m_PopWaitSeconds; }
+
+	private:
+		const size_t m_Capacity;
+		std::deque<T> m_Items;
+		bool m_Closed = false;
+		double m_PushWaitSeconds = 0.0;
+		double m_PopWaitSeconds = 0.0;
+		std::mutex m_Mutex;
+		std::condition_variable m_NotFull;
+		std::condition_variable m_NotEmpty;
+	};
+
+	// The work done by a stage, and the time it was busy: from its start to its end, less the time it waited on the
+	// queues to the stages around it.
+	struct StageStats
+	{
+		const char* name;
+		uint64_t points;
+		uint64_t bytes;
+		double seconds;
+
+		explicit StageStats(const char* stageName) : name(stageName), points(0), bytes(0), seconds(0.0) {}
+	};
+
+	// Runs produce(i) for every i in [0, count) as tasks, at most window at once, and hands their results to
+	// consume(result) in order on the calling thread. Should either throw, the tasks still running are waited for
+	// before the exception is passed on, as they write into the slots.
+	template <typename Result, typename Produce, typename Consume>
+	void orderedParallelMap(uint32_t count, uint32_t window, Produce produce, Consume consume)
+	{
+		struct Slot
+		{
+			TaskPool::Group group;
+			Result result;
+		};
+
+		TaskPool& pool = TaskPool::global();
+		std::deque<std::unique_ptr<Slot>> running;
+		uint32_t next = 0;
+		while (next < count || !running.empty())
+		{
+			while (next < count && running.size() < window)
+			{
+				running.emplace_back(new Slot);
+				Slot* slot = running.back().get();
+				uint32_t i = next++;
+				pool.run(slot->group, [slot, i, &produce]() { slot->result = produce(i); });
+			}
+
+			try
+			{
+				pool.wait(running.front()->group);
+				consume(std::move(running.front()->result));
+			}
+			catch (...)
+			{
+				for (const std::unique_ptr<Slot>& slot : running)
+				{
+					try
+					{
+						pool.wait(slot->group);
+					}
+					catch (...)
+					{
+					}
+				}
+				throw;
+			}
+			running.pop_front();
+		}
+	}
+
+	struct Options
+	{
+		std::string input;
+		std::string output;
+		uint32_t k = 1;
+		// Fixed unless picked by timing, which makes the tree, and so the output, depend on the machine and its load.
+		uint32_t leafCapacity = 8;
+		std::string type = "2i";
+		double epsilon = 0.0;
+		// The number of points whose neighbors are checked against an exhaustive search. None by default.
+		uint32_t verifyCount = 0;
+	};
+
+	template <uint32_t Dim, typename Coord>
+	struct ParsedChunk
+	{
+		BasicPointArrays<Dim, Coord> points;
+		uint64_t bytes = 0;
+		uint64_t lineCount = 0;
+		const char* error = nullptr;
+	};
+
+	struct OutputChunk
+	{
+		std::string text;
+		uint32_t pointCount = 0;
+	};
+
+	// Appends the line of the point at the given position: its name, then the name of and distance to each neighbor.
+	template <typename Tree>
+	void formatNeighbors(const Tree& tree, uint32_t position, const uint32_t* indices, const double* distances, uint32_t count, std::string& text)
+	{
+		size_t length;
+		const char* name = tree.name(tree.id(position), length);
+		text.append(name, length);
+		for (uint32_t i = 0; i < count; i++)
+		{
+			char distance[32];
+			std::snprintf(distance, sizeof(distance), " %.9g", distances[i]);
+			name = tree.name(tree.id(indices[i]), length);
+			text += ' ';
+			text.append(name, length);
+			text += distance;
+		}
+		text += '\n';
+	}
+
+	// The neighbors of the point at the given position, as written out.
+	template <uint32_t Dim, typename Coord>
+	uint32_t findNeighbors(const KdTree<Dim, Coord>& tree, uint32_t position, uint32_t k, double epsilon, uint32_t* indices, double* distances)
+	{
+		if (k > 1)
+			return tree.kNearestNeighborsOf(position, k, indices, distances, epsilon);
+
+		indices[0] = tree.nearestNeighborOf(position, distances[0], epsilon);
+		return 1;
+	}
+
+	// Checks the neighbors of count points spread evenly over the tree against an exhaustive search, which sums the
+	// squared differences as the tree does. The squared distance to the neighbor of each rank must be at most
+	// (1 + epsilon)^2 times the exact one, allowing for the rounding of the reported distance. Returns the number of
+	// points for which it is not.
+	template <uint32_t Dim, typename Coord>
+	uint32_t verifyNeighbors(const KdTree<Dim, Coord>& tree, uint32_t k, double epsilon, uint32_t count)
+	{
+		typedef CoordTraits<Coord> Traits;
+		const uint32_t size = tree.size();
+		const uint32_t stride = std::max(1u, size / count);
+		const uint32_t sampleCount = std::min(count, size);
+		const double bound = (1.0 + epsilon) * (1.0 + epsilon) * (1.0 + 1e-12);
+
+		std::atomic<uint32_t> failures(0);
+		TaskPool::global().parallelFor(sampleCount, [&](uint32_t sample)
+		{
+			const uint32_t position = sample * stride;
+			std::vector<uint32_t> indices(k);
+			std::vector<double> distances(k);
+			uint32_t found = findNeighbors(tree, position, k, epsilon, indices.data(), distances.data());
+
+			// The k smallest exact squared distances, smallest first, kept by insertion as the points go by.
+			std::vector<double> exact(k, std::numeric_limits<double>::infinity());
+			for (uint32_t i = 0; i < size; i++)
+			{
+				if (i == position)
+					continue;
+				typename Traits::Distance distSq = Traits::squaredDifference(tree.coords(0)[i], tree.coords(0)[position]);
+				for (uint32_t axis = 1; axis < Dim; axis++)
+					distSq = Traits::add(distSq, Traits::squaredDifference(tree.coords(axis)[i], tree.coords(axis)[position]));
+
+				double d = (double)distSq;
+				if (d >= exact[k - 1])
+					continue;
+				uint32_t rank = k - 1;
+				for (; rank > 0 && exact[rank - 1] > d; rank--)
+					exact[rank] = exact[rank - 1];
+				exact[rank] = d;
+			}
+
+			bool valid = found == std::min(k, size - 1);
+			for (uint32_t rank = 0; rank < found && valid; rank++)
+				valid = distances[rank] * distances[rank] <= bound * exact[rank];
+			if (!valid)
+				failures++;
+		});
+		return failures;
+	}
+
+	template <uint32_t Dim, typename Coord>
+	void run(const Options& options)
+	{
+		typedef KdTree<Dim, Coord> Tree;
+		const size_t ParseChunkSize = 1 << 22;
+		const uint32_t QueryChunkSize = 1 << 14;
+		const size_t QueueCapacity = 8;
+
+		TaskPool& pool = TaskPool::global();
+		// Enough chunks in flight to keep every thread busy, few enough to bound the memory they take.
+		const uint32_t window = pool.threadCount() * 2;
+		const Clock::time_point start = Clock::now();
+
+		MappedFile file(options.input);
+		const char* end = file.data() + file.size();
+		std::vector<const char*> chunkBegins;
+		for (const char* begin = file.data(); begin < end; begin = pointChunkEnd(begin, end, ParseChunkSize))
+			chunkBegins.push_back(begin);
+		chunkBegins.push_back(end);
+
+		// parse
+		StageStats parseStats("parse");
+		BoundedQueue<ParsedChunk<Dim, Coord>> parsed(QueueCapacity);
+		// Thrown by the parsing tasks, and passed on once the parser is done.
+		std::exception_ptr parseError;
+		std::thread parser([&]()
+		{
+			Clock::time_point stageStart = Clock::now();
+			auto parse = [&](uint32_t i)
+			{
+				ParsedChunk<Dim, Coord> chunk;
+				chunk.bytes = (uint64_t)(chunkBegins[i + 1] - chunkBegins[i]);
+				chunk.lineCount = parsePoints(chunkBegins[i], chunkBegins[i + 1], chunk.points, chunk.error);
+				return chunk;
+			};
+			auto hand = [&](ParsedChunk<Dim, Coord>&& chunk)
+			{
+				parseStats.points += chunk.points.size();
+				parseStats.bytes += chunk.bytes;
+				parsed.push(std::move(chunk));
+			};
+			try
+			{
+				orderedParallelMap<ParsedChunk<Dim, Coord>>((uint32_t)chunkBegins.size() - 1, window, parse, hand);
+			}
+			catch (...)
+			{
+				parseError = std::current_exception();
+			}
+			parsed.close();
+			parseStats.seconds = secondsSince(stageStart) - parsed.pushWaitSeconds();
+		});
+
+		// build
+		StageStats buildStats("build");
+		Clock::time_point buildStart = Clock::now();
+		BasicPointArrays<Dim, Coord> points;
+		points.nameOffsets.push_back(0);
+		uint64_t lineCount = 0;
+		std::string error;
+		ParsedChunk<Dim, Coord> chunk;
+		while (parsed.pop(chunk))
+		{
+			// The parser is drained even after an error, so that it does not wait on a full queue forever.
+			if (!error.empty())
+				continue;
+			if (chunk.error)
+			{
+				error = options.input + ":" + std::to_string(lineCount + chunk.lineCount + 1) + ": " + chunk.error + ".";
+				continue;
+			}
+			lineCount += chunk.lineCount;
+
+			const uint64_t nameBase = points.names.size();
+			for (uint32_t axis = 0; axis < Dim; axis++)
+				points.coords[axis].insert(points.coords[axis].end(), chunk.points.coords[axis].begin(), chunk.points.coords[axis].end());
+			points.names.insert(points.names.end(), chunk.points.names.begin(), chunk.points.names.end());
+			for (uint32_t i = 1; i <= chunk.points.size(); i++)
+				points.nameOffsets.push_back(nameBase + chunk.points.nameOffsets[i]);
+		}
+		parser.join();
+		if (parseError)
+			std::rethrow_exception(parseError);
+		if (!error.empty())
+			throw std::logic_error(error);
+		if (points.size() < 2)
+			throw std::logic_error(options.input + " holds fewer than two points.");
+
+		Tree tree;
+		buildStats.points = points.size();
+		tree.build(options.leafCapacity, std::move(points));
+		buildStats.seconds = secondsSince(buildStart) - parsed.popWaitSeconds();
+
+		// write
+		std::FILE* out = std::fopen(options.output.c_str(), "wb");
+		if (!out)
+			throw std::logic_error("Cannot write " + options.output + ".");
+
+		StageStats writeStats("write");
+		BoundedQueue<OutputChunk> formatted(QueueCapacity);
+		bool writeFailed = false;
+		std::thread writer([&]()
+		{
+			Clock::time_point stageStart = Clock::now();
+			OutputChunk output;
+			while (formatted.pop(output))
+			{
+				if (std::fwrite(output.text.data(), 1, output.text.size(), out) != output.text.size())
+					writeFailed = true;
+				writeStats.points += output.pointCount;
+				writeStats.bytes += output.text.size();
+			}
+			writeStats.seconds = secondsSince(stageStart) - formatted.popWaitSeconds();
+		});
+
+		// query
+		StageStats queryStats("query");
+		Clock::time_point queryStart = Clock::now();
+		const uint32_t k = std::min(options.k, tree.size() - 1);
+		auto query = [&](uint32_t chunkIndex)
+		{
+			OutputChunk output;
+			uint32_t begin = chunkIndex * QueryChunkSize;
+			uint32_t end = std::min(tree.size(), begin + QueryChunkSize);
+			std::vector<uint32_t> indices(k);
+			std::vector<double> distances(k);
+			for (uint32_t i = begin; i < end; i++)
+			{
+				uint32_t found = findNeighbors(tree, i, k, options.epsilon, indices.data(), distances.data());
+				formatNeighbors(tree, i, indices.data(), distances.data(), found, output.text);
+			}
+			output.pointCount = end - begin;
+			return output;
+		};
+		auto hand = [&](OutputChunk&& output)
+		{
+			queryStats.points += output.pointCount;
+			queryStats.bytes += output.text.size();
+			formatted.push(std::move(output));
+		};
+		try
+		{
+			orderedParallelMap<OutputChunk>((tree.size() + QueryChunkSize - 1) / QueryChunkSize, window, query, hand);
+		}
+		catch (...)
+		{
+			// The writer must be done with the file before it is closed and the exception passed on.
+			formatted.close();
+			writer.join();
+			std::fclose(out);
+			throw;
+		}
+		formatted.close();
+		queryStats.seconds = secondsSince(queryStart) - formatted.pushWaitSeconds();
+
+		writer.join();
+		if (std::fclose(out) != 0 || writeFailed)
+			throw std::logic_error("Cannot write " + options.output + ".");
+
+		// Points per second for the stages that produce points, megabytes per second for those that move bytes.
+		const StageStats stages[] = { parseStats, buildStats, queryStats, writeStats };
+		for (const StageStats& stage : stages)
+		{
+			std::printf("%-6s %9.3f s %12llu points %10.2f Mpoints/s", stage.name, stage.seconds, (unsigned long long)stage.points, stage.seconds > 0.0 ? stage.points / stage.seconds / 1e6 : 0.0);
+			if (stage.bytes > 0)
+				std::printf(" %10.1f MB/s", stage.seconds > 0.0 ? stage.bytes / stage.seconds / 1e6 : 0.0);
+			std::printf("\n");
+		}
+		std::printf("total  %9.3f s, %u threads, leaf capacity %u\n", secondsSince(start), pool.threadCount(), tree.leafCapacity());
+
+		if (options.verifyCount > 0)
+		{
+			uint32_t failures = verifyNeighbors(tree, k, options.epsilon, options.verifyCount);
+			std::printf("verify %u points, %u with a neighbor beyond the bound\n", std::min(options.verifyCount, tree.size()), failures);
+			if (failures > 0)
+				throw std::logic_error("Some neighbors are further than (1 + epsilon) times the exact ones.");
+		}
+	}
+
+	void printUsage()
+	{
+		std::cerr << "Usage: ann_batch <points> <output> [-k <count>] [-leaf <capacity>|auto] [-type 2i|2f|3f] [-epsilon <e>] [-verify <count>]" << std::endl;
+		std::cerr << "Writes, for every point of the input, a line with its name followed by the name of and distance to each" << std::endl;
+		std::cerr << "of its k nearest neighbors (1 by default). Lines follow the tree's order, not the input's, which only" << std::endl;
+		std::cerr << "depends on the input and the leaf capacity (8 by default): the output is the same from run to run." << std::endl;
+		std::cerr << "With -leaf auto, the leaf capacity is picked by timing queries instead, so the order may change." << std::endl;
+		std::cerr << "With -epsilon, neighbors may be up to (1 + e) times further than the exact ones, see KdTree.h." << std::endl;
+		std::cerr << "With -verify, the neighbors of that many points are checked against an exhaustive search, and the" << std::endl;
+		std::cerr << "exit code is 1 if any breaks that bound." << std::endl;
+	}
+}
+
+int main(int argc, char** argv)
+{
+	Options options;
+	std::vector<std::string> paths;
+	bool invalid = false;
+	for (int i = 1; i < argc; i++)
+	{
+		std::string arg = argv[i];
+		if ((arg == "-k" || arg == "-leaf" || arg == "-type" || arg == "-epsilon" || arg == "-verify") && i + 1 < argc)
+		{
+			std::string value = argv[++i];
+			if (arg == "-k")
+				options.k = (uint32_t)std::strtoul(value.c_str(), nullptr, 10);
+			else if (arg == "-leaf")
+			{
+				options.leafCapacity = value == "auto" ? KdTree<2, int32_t>::AutoLeafCapacity : (uint32_t)std::strtoul(value.c_str(), nullptr, 10);
+				// A capacity of 0 would ask for the timing too, but is more likely a mistake.
+				invalid = invalid || (value != "auto" && options.leafCapacity == 0);
+			}
+			else if (arg == "-epsilon")
+				options.epsilon = std::strtod(value.c_str(), nullptr);
+			else if (arg == "-verify")
+				options.verifyCount = (uint32_t)std::strtoul(value.c_str(), nullptr, 10);
+			else
+				options.type = value;
+		}
+		else
+			paths.push_back(arg);
+	}
+	if (paths.size() != 2 || options.k == 0 || invalid)
+	{
+		printUsage();
+		return 1;
+	}
+	options.input = paths[0];
+	options.output = paths[1];
+
+	try
+	{
+		if (options.type == "2i")
+			run<2, int32_t>(options);
+		else if (options.type == "2f")
+			run<2, float>(options);
+		else if (options.type == "3f")
+			run<3, float>(options);
+		else
+		{
+			printUsage();
+			return 1;
+		}
+	}
+	catch (const std::exception& e)
+	{
+		std::cerr << e.what() << std::endl;
+		return 1;
+	}
+	return 0;
+}
\ No newline at end of file
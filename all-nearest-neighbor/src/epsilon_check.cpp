@@ -0,0 +1,150 @@
+// Checks the approximate nearest neighbor queries against an exhaustive search: for every epsilon, the squared
+// distance to the neighbor of each rank must be at most (1 + epsilon)^2 times the exact one. Runs over 2D int32,
+// 2D float and 3D float trees, on uniform, clustered and coincident points. Built as a project of its own, which runs
+// it after every build so that a broken bound fails the build. Prints the failures and exits with 1 if there are any.
+
+#include "../include/KdTree.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <limits>
+#include <random>
+#include <string>
+#include <vector>
+
+
+namespace
+{
+	const double Epsilons[] = { 0.0, 0.1, 1.0 };
+	const uint32_t PointCount = 4000;
+	const uint32_t QueryCount = 300;
+	const uint32_t K = 4;
+
+	// The k smallest squared distances from q to the points of the tree, other than the one at position self,
+	// smallest first. Sums the squared differences as the tree does, so that exact searches match to the last bit.
+	template <uint32_t Dim, typename Coord>
+	void exactNeighbors(const KdTree<Dim, Coord>& tree, const Coord* q, uint32_t self, uint32_t k, std::vector<double>& nearest)
+	{
+		typedef CoordTraits<Coord> Traits;
+		nearest.assign(k, std::numeric_limits<double>::infinity());
+		for (uint32_t i = 0; i < tree.size(); i++)
+		{
+			if (i == self)
+				continue;
+			typename Traits::Distance distSq = Traits::squaredDifference(tree.coords(0)[i], q[0]);
+			for (uint32_t axis = 1; axis < Dim; axis++)
+				distSq = Traits::add(distSq, Traits::squaredDifference(tree.coords(axis)[i], q[axis]));
+
+			double d = (double)distSq;
+			if (d >= nearest[k - 1])
+				continue;
+			uint32_t rank = k - 1;
+			for (; rank > 0 && nearest[rank - 1] > d; rank--)
+				nearest[rank] = nearest[rank - 1];
+			nearest[rank] = d;
+		}
+	}
+
+	// Whether the reported distances, closest first, are within the bound of the exact squared ones.
+	bool withinBound(const double* distances, uint32_t found, const std::vector<double>& exact, double epsilon)
+	{
+		// Allows for the rounding of the reported distance, a square root.
+		const double bound = (1.0 + epsilon) * (1.0 + epsilon) * (1.0 + 1e-12);
+		if (found != exact.size())
+			return false;
+		for (uint32_t rank = 0; rank < found; rank++)
+		{
+			if (!(distances[rank] * distances[rank] <= bound * exact[rank]))
+				return false;
+		}
+		return true;
+	}
+
+	template <uint32_t Dim, typename Coord>
+	std::vector<BasicPoint<Dim, Coord>> makePoints(const std::string& distribution, std::mt19937& random)
+	{
+		std::uniform_real_distribution<double> uniform(-1e6, 1e6);
+		std::normal_distribution<double> spread(0.0, 500.0);
+		std::vector<BasicPoint<Dim, Coord>> points(PointCount);
+		for (uint32_t i = 0; i < PointCount; i++)
+		{
+			for (uint32_t axis = 0; axis < Dim; axis++)
+			{
+				double value = uniform(random);
+				if (distribution == "clustered")
+					value = (double)(i % 8) * 1e5 + spread(random);
+				else if (distribution == "coincident")
+					value = (double)(i % 50) * 10.0;
+				points[i][axis] = (Coord)value;
+			}
+		}
+		return points;
+	}
+
+	// Returns the number of queries whose neighbors break the bound.
+	template <uint32_t Dim, typename Coord>
+	uint32_t check(const char* type, uint32_t seed)
+	{
+		typedef KdTree<Dim, Coord> Tree;
+		const char* distributions[] = { "uniform", "clustered", "coincident" };
+		std::mt19937 random(seed);
+		uint32_t failures = 0;
+
+		for (const char* distribution : distributions)
+		{
+			Tree tree;
+			tree.build(8, makePoints<Dim, Coord>(distribution, random));
+			// Named apart from the points of the tree, so that none is taken for the query itself.
+			std::vector<BasicPoint<Dim, Coord>> queries = makePoints<Dim, Coord>(distribution, random);
+			for (BasicPoint<Dim, Coord>& q : queries)
+				q.m_name = "query";
+			std::uniform_int_distribution<uint32_t> position(0, tree.size() - 1);
+
+			for (double epsilon : Epsilons)
+			{
+				std::vector<uint32_t> allIndices(tree.size());
+				std::vector<double> allDistances(tree.size());
+				tree.allNearestNeighbors(allIndices.data(), allDistances.data(), epsilon);
+
+				uint32_t failed = 0;
+				std::vector<double> exact;
+				uint32_t indices[K];
+				double distances[K];
+				for (uint32_t i = 0; i < QueryCount; i++)
+				{
+					// A point of the tree, which leaves itself out, then one from outside.
+					uint32_t self = position(random);
+					exactNeighbors(tree, tree.point(self).m_coords, self, 1, exact);
+					tree.nearestNeighborOf(self, distances[0], epsilon);
+					bool valid = withinBound(distances, 1, exact, epsilon) && withinBound(&allDistances[self], 1, exact, epsilon);
+
+					exactNeighbors(tree, tree.point(self).m_coords, self, K, exact);
+					valid = valid && withinBound(distances, tree.kNearestNeighborsOf(self, K, indices, distances, epsilon), exact, epsilon);
+
+					const BasicPoint<Dim, Coord>& q = queries[i];
+					exactNeighbors(tree, q.m_coords, Tree::InvalidIndex, K, exact);
+					valid = valid && withinBound(distances, tree.kNearestNeighbors(q, K, indices, distances, epsilon), exact, epsilon);
+
+					if (!valid)
+						failed++;
+				}
+
+				std::printf("%-3s %-10s epsilon %-4g %u of %u queries beyond the bound\n", type, distribution, epsilon, failed, QueryCount);
+				failures += failed;
+			}
+		}
+		return failures;
+	}
+}
+
+int main()
+{
+	uint32_t failures = check<2, int32_t>("2i", 1) + check<2, float>("2f", 2) + check<3, float>("3f", 3);
+	if (failures > 0)
+	{
+		std::printf("Some neighbors are further than (1 + epsilon) times the exact ones.\n");
+		return 1;
+	}
+	return 0;
+}
\ No newline at end of file
@@ -19,7 +19,7 @@
 #include <cmath>
 #include <string>
 
-KdTree g_kdtree;
+KdTree2i g_kdtree;
 std::vector<Point> g_points;
 
 ImVec4 g_canvas_color = ImVec4(0.225f, 0.275f, 0.3f, 1.00f);
@@ -35,26 +35,26 @@ static void error_callback(int error, const char* description)
     fprintf(stderr, "Error %d: %s\n", error, description);
 }
 
-void drawKdTree(ImDrawList* draw_list, KdTreeNode* node, AABB aabb)
+void drawKdTree(ImDrawList* draw_list, const KdTree2i::Node* node, AABB aabb)
 {
 	if (node->isLeaf())
 		return;
 
-	if (node->axis == 0)
-		draw_list->AddLine(ImVec2(node->value + g_translation.x, aabb.min.m_y + g_translation.y), ImVec2(node->value + g_translation.x, aabb.max.m_y + g_translation.y), ImColor(0.1f, 0.7f, 0.4f, 2.0f));
+	if (node->axis() == 0)
+		draw_list->AddLine(ImVec2(node->value + g_translation.x, aabb.min[1] + g_translation.y), ImVec2(node->value + g_translation.x, aabb.max[1] + g_translation.y), ImColor(0.1f, 0.7f, 0.4f, 2.0f));
 	else
-		draw_list->AddLine(ImVec2(aabb.min.m_x + g_translation.x, node->value + g_translation.y), ImVec2(aabb.max.m_x + g_translation.x, node->value + g_translation.y), ImColor(0.1f, 0.7f, 0.4f, 2.0f));
+		draw_list->AddLine(ImVec2(aabb.min[0] + g_translation.x, node->value + g_translation.y), ImVec2(aabb.max[0] + g_translation.x, node->value + g_translation.y), ImColor(0.1f, 0.7f, 0.4f, 2.0f));
 	
 	AABB aabbLeft = aabb;
 	AABB aabbRight = aabb;
 
-	if (node->axis == 0)
-		aabbLeft.max.m_x = aabbRight.min.m_x = node->value;
+	if (node->axis() == 0)
+		aabbLeft.max[0] = aabbRight.min[0] = node->value;
 	else
-		aabbLeft.max.m_y = aabbRight.min.m_y = node->value;
+		aabbLeft.max[1] = aabbRight.min[1] = node->value;
 
-	drawKdTree(draw_list, node->left, aabbLeft);
-	drawKdTree(draw_list, node->right, aabbRight);
+	drawKdTree(draw_list, node->left(), aabbLeft);
+	drawKdTree(draw_list, node->right(), aabbRight);
 }
 
 static void ShowExampleAppFixedOverlay(bool* p_open)
@@ -116,24 +116,24 @@ void ShowExampleAppCustomRendering(bool* p_open)
 	draw_list->AddLine(ImVec2(-99999 + g_translation.x, g_translation.y), ImVec2(99999 + g_translation.x, g_translation.y), ImColor(0.4f, 0.4f, 0.4f, 1.0f), 1.5f);
 	draw_list->AddLine(ImVec2(g_translation.x, -99999 + g_translation.y), ImVec2(g_translation.x, 99999 + g_translation.y), ImColor(0.4f, 0.4f, 0.4f, 1.0f), 1.5f);
 
-	if (g_kdtree.m_Root != nullptr)
+	if (!g_kdtree.m_Nodes.empty())
 	{			
-		draw_list->AddLine(ImVec2(g_kdtree.m_AABB.min.m_x + g_translation.x, g_kdtree.m_AABB.min.m_y + g_translation.y), ImVec2(g_kdtree.m_AABB.min.m_x + g_translation.x, g_kdtree.m_AABB.max.m_y + g_translation.y), ImColor(0.1f, 0.7f, 0.4f, 2.0f));
-		draw_list->AddLine(ImVec2(g_kdtree.m_AABB.min.m_x + g_translation.x, g_kdtree.m_AABB.min.m_y + g_translation.y), ImVec2(g_kdtree.m_AABB.max.m_x + g_translation.x, g_kdtree.m_AABB.min.m_y + g_translation.y), ImColor(0.1f, 0.7f, 0.4f, 2.0f));
-		draw_list->AddLine(ImVec2(g_kdtree.m_AABB.max.m_x + g_translation.x, g_kdtree.m_AABB.max.m_y + g_translation.y), ImVec2(g_kdtree.m_AABB.min.m_x + g_translation.x, g_kdtree.m_AABB.max.m_y + g_translation.y), ImColor(0.1f, 0.7f, 0.4f, 2.0f));
-		draw_list->AddLine(ImVec2(g_kdtree.m_AABB.max.m_x + g_translation.x, g_kdtree.m_AABB.max.m_y + g_translation.y), ImVec2(g_kdtree.m_AABB.max.m_x + g_translation.x, g_kdtree.m_AABB.min.m_y + g_translation.y), ImColor(0.1f, 0.7f, 0.4f, 2.0f));
+		draw_list->AddLine(ImVec2(g_kdtree.m_AABB.min[0] + g_translation.x, g_kdtree.m_AABB.min[1] + g_translation.y), ImVec2(g_kdtree.m_AABB.min[0] + g_translation.x, g_kdtree.m_AABB.max[1] + g_translation.y), ImColor(0.1f, 0.7f, 0.4f, 2.0f));
+		draw_list->AddLine(ImVec2(g_kdtree.m_AABB.min[0] + g_translation.x, g_kdtree.m_AABB.min[1] + g_translation.y), ImVec2(g_kdtree.m_AABB.max[0] + g_translation.x, g_kdtree.m_AABB.min[1] + g_translation.y), ImColor(0.1f, 0.7f, 0.4f, 2.0f));
+		draw_list->AddLine(ImVec2(g_kdtree.m_AABB.max[0] + g_translation.x, g_kdtree.m_AABB.max[1] + g_translation.y), ImVec2(g_kdtree.m_AABB.min[0] + g_translation.x, g_kdtree.m_AABB.max[1] + g_translation.y), ImColor(0.1f, 0.7f, 0.4f, 2.0f));
+		draw_list->AddLine(ImVec2(g_kdtree.m_AABB.max[0] + g_translation.x, g_kdtree.m_AABB.max[1] + g_translation.y), ImVec2(g_kdtree.m_AABB.max[0] + g_translation.x, g_kdtree.m_AABB.min[1] + g_translation.y), ImColor(0.1f, 0.7f, 0.4f, 2.0f));
 
-		drawKdTree(draw_list, g_kdtree.m_Root, g_kdtree.m_AABB);
+		drawKdTree(draw_list, g_kdtree.m_Nodes.data(), g_kdtree.m_AABB);
 	}
 
 	for (size_t i = 0; i < g_points.size(); i++)
 	{
-		ImVec2 pos = ImVec2(g_points[i].m_x + g_translation.x, g_points[i].m_y + g_translation.y);
+		ImVec2 pos = ImVec2(g_points[i][0] + g_translation.x, g_points[i][1] + g_translation.y);
 		draw_list->AddCircleFilled(pos, 2.0f, IM_COL32(255, 255, 255, 255), 5);
 	}
 
-	draw_list->AddCircleFilled(ImVec2(nearest.m_x + g_translation.x, nearest.m_y + g_translation.y), 3.5f, IM_COL32(255, 0, 0, 255), 10);
-	draw_list->AddCircleFilled(ImVec2(query.m_x + g_translation.x, query.m_y + g_translation.y), 3.5f, IM_COL32(0, 255, 0, 255), 10);
+	draw_list->AddCircleFilled(ImVec2(nearest[0] + g_translation.x, nearest[1] + g_translation.y), 3.5f, IM_COL32(255, 0, 0, 255), 10);
+	draw_list->AddCircleFilled(ImVec2(query[0] + g_translation.x, query[1] + g_translation.y), 3.5f, IM_COL32(0, 255, 0, 255), 10);
 	
 	draw_list->PopClipRect();
 